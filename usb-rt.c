@@ -15,25 +15,36 @@
 #include <linux/kref.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/pci.h>
+#include <linux/irq.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
+#include <linux/pm_qos.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/anon_inodes.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/version.h>
 #include "usb_rt_version.h"
+#include "usb_rt_ioctl.h"
 
 MODULE_VERSION(USB_RT_VERSION_STRING);
 /* Define these values to match your devices */
 #define UNHUMAN_VENDOR_ID	0x3293
 #define UNHUMAN_MTR_PRODUCT_ID	0x0100
 
-/* table of devices that work with this driver */
-static const struct usb_device_id usb_rt_table[] = {
-	{ USB_DEVICE_INTERFACE_NUMBER(UNHUMAN_VENDOR_ID, UNHUMAN_MTR_PRODUCT_ID, 0)},
-	{} 					/* Terminating entry */
-};
-MODULE_DEVICE_TABLE(usb, usb_rt_table);
-
-
-/* Get a minor range for your devices from the usb maintainer */
-#define USB_RT_MINOR_BASE	192
+/* devices supported, each gets a minor of our own char device region */
+#define USB_RT_MINORS		256
+/* the control node takes the minor after them */
+#define USB_RT_CTL_MINOR	USB_RT_MINORS
 
 /* our private defines. if this grows any larger, use your own .h file */
 #define MAX_TRANSFER		(PAGE_SIZE - 512)
@@ -44,13 +55,151 @@ MODULE_DEVICE_TABLE(usb, usb_rt_table);
  */
 #define WRITES_IN_FLIGHT	8
 /* arbitrarily chosen */
+#define PRIORITY_WRITES_IN_FLIGHT	2
+/* urb slots reserved for priority writes */
+#define IDLE_GAP_US		1000
+/* reads submitted after this much idle time are counted as after idle */
+#define LATENCY_BUCKETS		80
+/* read latency histogram, 4 buckets per octave up to about 1 s in us */
+#define LATENCY_WINDOW		4096
+/* the histogram is halved when it holds this many samples */
+#define LATENCY_MIN_SAMPLES	64
+/* samples needed before the adaptive timeout is used */
+#define COALESCE_HEADER		2
+/* coalesced records are prefixed with a little endian u16 length */
+#define EVENTS_QUEUED		16
+/* out of band events kept until read, the oldest is dropped on overflow */
+#define HC_IRQS_MAX		64
+/* host controller irq vectors listed in sysfs */
+#define READ_SAMPLES_QUEUED	64
+/* bytes of control packets queued, with their headers */
+#define CONTROL_QUEUE_SIZE	8192
+/* control packet types after the 0 byte, both carry an 8 byte header */
+#define CONTROL_TIMEOUT		1
+#define CONTROL_LONG		2
+#define CONTROL_HEADER		8
+/* read completions waiting for the completion worker */
+#define SG_WRITE_MAX		(16 * 1024 * 1024)
+/* largest zero copy write */
+#define SG_WRITES_QUEUED	WRITES_IN_FLIGHT
+/* zero copy writes per fd on the bus or with an unread WRITE_DONE event */
+#define RING_DEVS		64
+/* devices enrolled in one shared receive ring */
+#define ENROLLED_ERRORS_MAX	8
+/* read errors in a row an enrolled device retries before its read stops */
+#define GROUP_MEMBERS_MAX	64
+#define GROUP_WRITE_MAX		(64 * 1024)
+/* aggregated floats saturate here so a window of TAP_WINDOW_MAX can't overflow */
+#define TAP_Q16_MAX		(1LL << 46)
+#define TAP_WINDOW_MAX		65535
+/* taps per device, each one adds a copy or aggregation to every packet */
+#define TAP_MAX			8
+#define STREAM_URBS_MAX		64
+#define STREAM_URB_SIZE_MAX	(64 * 1024)
+/* limits of the throughput receive mode */
+
+/* per product defaults, applied to every channel at probe */
+struct usb_rt_profile {
+	const char		*name;			/* node name prefix */
+	unsigned int		write_depth;		/* writes on the bus, at most WRITES_IN_FLIGHT */
+	unsigned int		max_transfer;		/* largest write, at most MAX_TRANSFER */
+	unsigned int		timeout_ms;		/* read timeout */
+	bool			timeout_adaptive;	/* derive the read timeout from latency */
+	unsigned int		coalesce_us;		/* coalesced transfer delay */
+	unsigned int		coalesce_bytes;		/* coalesced transfer size */
+	int			cpu_latency_us;		/* default realtime cpu latency bound */
+};
+
+/* used for ids added through new_id without a reference device */
+static const struct usb_rt_profile usb_rt_default_profile = {
+	.name =			"usbrt",
+	.write_depth =		WRITES_IN_FLIGHT,
+	.max_transfer =		MAX_TRANSFER,
+	.timeout_ms =		10,
+	.coalesce_us =		500,
+	.coalesce_bytes =	512,
+	.cpu_latency_us =	-1,
+};
+
+/*
+ * motors run a command/reply control loop: keep few normal writes ahead of
+ * priority ones and flush coalesced commands within a loop period
+ */
+static const struct usb_rt_profile usb_rt_mtr_profile = {
+	.name =			"mtr",
+	.write_depth =		2,
+	.max_transfer =		MAX_TRANSFER,
+	.timeout_ms =		10,
+	.coalesce_us =		100,
+	.coalesce_bytes =	512,
+	.cpu_latency_us =	-1,
+};
+
+/*
+ * table of devices that work with this driver, driver_info points to the
+ * product profile. Ids added through new_id can take it from an existing
+ * entry by naming it as reference device.
+ */
+static const struct usb_device_id usb_rt_table[] = {
+	{ USB_DEVICE_INTERFACE_NUMBER(UNHUMAN_VENDOR_ID, UNHUMAN_MTR_PRODUCT_ID, 0),
+	  .driver_info = (kernel_ulong_t)&usb_rt_mtr_profile },
+	{ USB_DEVICE_INTERFACE_CLASS(UNHUMAN_VENDOR_ID, UNHUMAN_MTR_PRODUCT_ID, USB_CLASS_VENDOR_SPEC),
+	  .driver_info = (kernel_ulong_t)&usb_rt_mtr_profile },
+	{} 					/* Terminating entry */
+};
+MODULE_DEVICE_TABLE(usb, usb_rt_table);
+
+/* a coherent buffer for a write urb */
+struct usb_rt_wbuf {
+	unsigned char		*buf;
+	dma_addr_t		dma;
+	size_t			len;
+};
+
+struct usb_rt_latency {
+	u64			count;
+	u64			total_ns;
+	u64			max_ns;
+};
+
+/* a zero copy write from pinned user pages */
+struct usb_rt_sg_write_ctx {
+	struct usb_rt		*dev;
+	struct usb_rt_file	*f;			/* gets the completion event */
+	struct urb		*urb;
+	struct page		**pages;
+	int			nr_pages;		/* pages pinned */
+	struct sg_table		sgt;
+	__u64			cookie;			/* returned in the completion event */
+};
+
+/* timing of a read completion, accounted inline or by the completion worker */
+struct usb_rt_read_sample {
+	u64			latency_ns;
+	bool			idle;			/* submitted after an idle gap */
+};
 
 /* Structure to hold all of our device specific stuff */
 struct usb_rt {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
+	struct device		*node;			/* the char device node */
+	int			minor;			/* minor of node, -1 if none */
+	struct usb_rt		*next;			/* next channel on the interface */
+	unsigned int		channel;		/* endpoint pair index on the interface */
 	struct semaphore	limit_sem;		/* limiting the number of writes in progress */
+	struct semaphore	prio_sem;		/* limiting the number of priority writes */
 	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
+	struct usb_anchor	deferred;		/* writes waiting for room on the bus */
+	struct usb_anchor	write_failed;		/* deferred writes that failed to submit */
+	struct work_struct	write_free_work;	/* frees write_failed outside err_lock */
+	unsigned int		out_busy;		/* queued writes on the bus, protected by err_lock */
+	unsigned int		out_depth;		/* queued writes allowed on the bus */
+	unsigned int		pace_rate;		/* writes per second, 0 for no pacing */
+	unsigned int		pace_burst;		/* writes allowed back to back */
+	u64			pace_tat;		/* theoretical arrival time of the next write in ns */
+	struct hrtimer		pace_timer;		/* releases paced writes */
+	unsigned int		pace_waits;		/* times writes were held back for pacing */
 	struct urb		*bulk_in_urb;		/* the urb to read data with */
 	unsigned char           *bulk_in_buffer;	/* the buffer to receive data */
 	size_t			bulk_in_size;		/* the size of the receive buffer */
@@ -59,28 +208,285 @@ struct usb_rt {
 	unsigned char	*text_api_buffer;
 	__u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
 	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
+	__u8			bulk_in_interval;	/* bInterval of an interrupt in endpoint, 0 for bulk */
+	__u8			bulk_out_interval;	/* bInterval of an interrupt out endpoint, 0 for bulk */
 	int			errors;			/* the last request tanked */
 	bool			ongoing_read;		/* a read is going on */
+	bool			read_stale;		/* the read in flight belongs to a timed out read */
+	bool			read_cancelled;		/* the read in flight was cancelled */
+	unsigned int		reads_abandoned;	/* timed out reads whose reply is dropped */
 	spinlock_t		err_lock;		/* lock for errors */
 	struct kref		kref;
 	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
-	unsigned long		disconnected:1;
+	struct mutex		reset_mutex;		/* of the first channel, nests all io_mutexes */
+	unsigned long		disconnected:1;		/* set under io_mutex and err_lock */
 	wait_queue_head_t	bulk_in_wait;		/* to wait for an ongoing read */
 	bool 			has_text_api;
 	unsigned int	timeout_ms;
+	size_t			max_transfer;		/* largest write */
+	int			numa_node;		/* node for buffers allocated after probe */
+	int			cpu_latency_us;		/* default realtime cpu latency bound, <0 none */
+	struct mutex		realtime_mutex;		/* protects realtime_count and lpm_disabled */
+	int			realtime_count;		/* fds in realtime mode */
+	bool			lpm_disabled;		/* link power management is off */
+	ktime_t			bulk_in_submitted;	/* time the read urb was submitted */
+	ktime_t			bulk_in_completed;	/* time the last read urb completed */
+	struct usb_rt_latency	read_latency;		/* read urb latency while streaming */
+	struct usb_rt_latency	read_latency_idle;	/* read urb latency after idle */
+	u32			latency_hist[LATENCY_BUCKETS];	/* read latency histogram, protected by err_lock */
+	u32			latency_samples;	/* samples in latency_hist */
+	bool			timeout_adaptive;	/* derive the read timeout from latency_hist */
+	unsigned int		timeout_quantile;	/* latency quantile in per mille */
+	unsigned int		timeout_multiple;	/* timeout as percent of the quantile */
+	unsigned int		timeout_min_ms;		/* adaptive timeout bounds */
+	unsigned int		timeout_max_ms;
+	unsigned int		timeout_effective_us;	/* adaptive timeout, 0 until enough samples */
+	unsigned int		timeout_adjustments;	/* changes of timeout_effective_us */
+	bool			rearm_read;		/* read interrupted by suspend or reset */
+	struct mutex		completion_mutex;	/* serializes completion worker setup */
+	struct kthread_worker	*completion_worker;	/* deferred completion work, NULL for inline */
+	struct kthread_work	completion_work;
+	int			completion_cpu;		/* cpu of completion_worker, -1 for inline */
+	unsigned int		completion_priority;	/* SCHED_FIFO priority, 0 for SCHED_NORMAL */
+	DECLARE_KFIFO(read_samples, struct usb_rt_read_sample, READ_SAMPLES_QUEUED);	/* protected by err_lock */
+	unsigned int		read_samples_dropped;	/* samples lost to a full read_samples */
+	bool			read_deferred;		/* read reply left to completion_worker */
+	unsigned int		read_deferred_len;
+	unsigned int		stream_urbs;		/* read urbs of the throughput mode, 0 for off */
+	unsigned int		stream_urb_size;	/* bytes per stream urb */
+	unsigned int		stream_ring_kb;		/* size of stream_ring */
+	struct urb		**stream_urb;		/* the stream urbs */
+	struct usb_anchor	stream_submitted;	/* stream urbs on the bus */
+	struct usb_anchor	stream_idle;		/* stream urbs waiting for room in stream_ring */
+	struct usb_anchor	stream_done;		/* stream urbs waiting for completion_worker */
+	struct kfifo		stream_ring;		/* received stream data */
+	size_t			stream_reserved;	/* room in stream_ring owed to urbs on the bus */
+	bool			stream_enabled;		/* stream urbs may be submitted */
+	bool			stream_held;		/* stream urbs held back for suspend or reset */
+	u64			stream_bytes;		/* bytes received since the mode was entered */
+	ktime_t			stream_start;		/* time the mode was entered */
+	unsigned int		stream_stalls;		/* times a stream urb waited for room */
+	struct usb_rt_ring	*ring;			/* shared receive ring, protected by err_lock */
+	u32			ring_seq;		/* sequence of the next record published */
+	struct usb_rt_group	*group;			/* device group, protected by err_lock */
+	unsigned int		group_member;		/* index in group */
+	struct list_head	taps;			/* monitoring fds, changed under err_lock and tap_lock */
+	spinlock_t		tap_lock;		/* protects the taps, nests inside err_lock */
+	unsigned int		ntaps;			/* in taps, at most TAP_MAX */
+	bool			control_split;		/* control packets go to control */
+	struct kfifo		control;		/* control packets, protected by err_lock */
+	unsigned int		control_dropped;	/* control packets lost to a full queue */
+	unsigned int		control_long_left;	/* bytes of a long packet still to come */
+	u32			read_extend_us;		/* timeout request for the read in flight */
+	unsigned int		enrolled_errors;	/* read errors in a row while in a ring or group */
+	DECLARE_KFIFO(events, struct usb_rt_event, EVENTS_QUEUED);	/* protected by err_lock */
+	struct work_struct	stall_work;		/* clears halted endpoints */
+	bool			in_halted;		/* the bulk in endpoint stalled */
+	bool			out_halted;		/* the bulk out endpoint stalled */
+	ktime_t			stall_start;		/* time of the first unrecovered stall */
+	unsigned int		stall_recoveries;	/* stalls cleared */
+	unsigned int		writes_killed;		/* writes unlinked before completion */
+	struct mutex		latest_mutex;		/* serializes latest wins writers */
+	struct urb		*latest_urb;		/* the urb for latest wins writes */
+	struct usb_rt_wbuf	latest_bus;		/* command owned by latest_urb */
+	struct usb_rt_wbuf	latest_pending;		/* command sent when latest_urb completes */
+	struct usb_rt_wbuf	latest_fill;		/* filled by the writer holding latest_mutex */
+	bool			latest_busy;		/* latest_urb is submitted, protected by err_lock */
+	bool			latest_valid;		/* latest_pending holds a command, protected by err_lock */
+	unsigned int		writes_replaced;	/* pending commands overwritten by newer ones */
+	struct mutex		coalesce_mutex;		/* serializes coalescing writers */
+	unsigned char		*coalesce_stage;	/* user data staged by the writer holding coalesce_mutex */
+	struct urb		*coalesce_urb;		/* the urb for coalesced writes */
+	struct usb_rt_wbuf	coalesce_bus;		/* records owned by coalesce_urb */
+	struct usb_rt_wbuf	coalesce_fill;		/* records being collected, protected by err_lock */
+	unsigned int		coalesce_records;	/* records in coalesce_fill */
+	bool			coalesce_busy;		/* coalesce_urb is submitted, protected by err_lock */
+	bool			coalesce_flush;		/* flush coalesce_fill when coalesce_urb completes */
+	struct hrtimer		coalesce_timer;		/* flushes coalesce_fill after coalesce_us */
+	wait_queue_head_t	coalesce_wait;		/* writers waiting for coalesce_urb */
+	unsigned int		coalesce_us;		/* window for collecting records */
+	unsigned int		coalesce_bytes;		/* flush when this many bytes are collected */
+	unsigned int		writes_coalesced;	/* records sent in coalesced transfers */
+	unsigned int		coalesced_transfers;	/* coalesced transfers sent */
 };
 #define to_usb_rt_dev(d) container_of(d, struct usb_rt, kref)
 
+/* Per open file state */
+/*
+ * A shared receive ring of a control node fd, mapped by userspace. The read
+ * completions of every enrolled device publish into it without a common
+ * lock: a record is reserved by incrementing head and committed by storing
+ * its index + 1 in its seq field.
+ */
+struct usb_rt_ring {
+	void			*mem;			/* header and records, mapped by userspace */
+	struct usb_rt_ring_header *header;
+	struct usb_rt_record	*records;
+	atomic64_t		head;			/* index of the next record */
+	wait_queue_head_t	wait;			/* for poll() */
+	struct mutex		lock;			/* protects devs */
+	struct usb_rt		*devs[RING_DEVS];	/* enrolled devices */
+};
+
+struct usb_rt_group_member {
+	struct usb_rt		*dev;
+	struct usb_rt_group	*group;
+	u8			*data;			/* reply of the current cycle */
+	unsigned int		size;
+	unsigned int		len;
+	int			status;
+	bool			pending;		/* reply outstanding */
+	u64			reply_ns;		/* since the cycle started */
+	unsigned int		urb_size;		/* of cmd_buf and bcast_buf */
+	struct urb		*cmd_urb;		/* preallocated for commands */
+	u8			*cmd_buf;
+	bool			cmd_busy;		/* cmd_urb on the bus, protected by dev->err_lock */
+	struct urb		*bcast_urb;		/* preallocated for broadcasts */
+	u8			*bcast_buf;
+	int			bcast_status;
+	u64			bcast_submit_ns;
+	u64			bcast_complete_ns;
+};
+
+/*
+ * A device group fd. A write() starts a cycle by sending commands to some
+ * members, the first packet each of them receives afterwards is its reply.
+ * read() waits until all replies are in or the deadline passed.
+ */
+struct usb_rt_group {
+	spinlock_t		lock;			/* protects the cycle, nests in err_lock */
+	struct mutex		mutex;			/* serializes read and write */
+	wait_queue_head_t	wait;
+	u32			cycle;
+	bool			active;			/* cycle written and not read */
+	unsigned int		pending;		/* replies outstanding */
+	u64			start_ns;
+	unsigned int		timeout_ms;
+	unsigned int		unexpected;		/* packets outside a cycle */
+	unsigned int		bcast_pending;		/* broadcast urbs on the bus */
+	unsigned int		nmembers;
+	struct usb_rt_group_member members[];
+};
+
+/*
+ * A tap fd sees a decimated copy of the packets of a device without taking
+ * them from its reader, either every Nth packet or at most one per interval.
+ * With fields configured it instead aggregates them per window of N packets
+ * or one interval. Only the latest result is kept.
+ */
+struct usb_rt_tap {
+	struct list_head	node;			/* in dev->taps */
+	struct usb_rt		*dev;
+	wait_queue_head_t	wait;
+	struct mutex		lock;			/* serializes read */
+	unsigned int		every;
+	u64			interval_ns;
+	unsigned int		nfields;
+	u16			fields[USB_RT_TAP_FIELDS];
+	/* the rest is protected by dev->tap_lock */
+	unsigned int		count;			/* packets in the window */
+	u64			start_ns;		/* of the window or last packet delivered */
+	u32			min[USB_RT_TAP_FIELDS];
+	u32			max[USB_RT_TAP_FIELDS];
+	s64			sum[USB_RT_TAP_FIELDS];
+	bool			ready;			/* result not read yet */
+	unsigned int		overwritten;		/* results never read */
+	unsigned int		len;
+	unsigned int		size;
+	u8			*buf;			/* packet or struct usb_rt_tap_window */
+	u8			*out;			/* copy of buf for read() */
+};
+
+struct usb_rt_file {
+	struct usb_rt		*dev;
+	struct mutex		lock;			/* serializes fd configuration */
+	u32			flags;			/* USB_RT_FLAG_* */
+	bool			realtime;		/* fd is in realtime mode */
+	struct pm_qos_request	qos;			/* cpu latency request while realtime */
+	/* the rest is protected by dev->err_lock */
+	DECLARE_KFIFO(sg_done, struct usb_rt_event, SG_WRITES_QUEUED);	/* WRITE_DONE events */
+	unsigned int		sg_pending;		/* zero copy writes on the bus or in sg_done */
+	unsigned int		sg_busy;		/* zero copy writes on the bus */
+	bool			released;		/* freed by the last zero copy completion */
+};
+
 static struct usb_driver usb_rt_driver;
+static dev_t usb_rt_devt;
+static struct cdev usb_rt_cdev;
+static struct cdev usb_rt_ctl_cdev;
+static struct class *usb_rt_class;
+/* open looks up devices by minor, protected by usb_rt_minors_lock */
+static struct usb_rt *usb_rt_minors[USB_RT_MINORS];
+static DEFINE_MUTEX(usb_rt_minors_lock);
 static void usb_rt_draw_down(struct usb_rt *dev);
+static int usb_rt_cancel_writes(struct usb_rt *dev);
+static int usb_rt_coalesce_drop(struct usb_rt *dev);
+static void usb_rt_clear_kill_errors(struct usb_rt *dev);
+static void usb_rt_completion_work(struct kthread_work *work);
+static void usb_rt_stream_fill(struct usb_rt *dev);
+
+static void usb_rt_hrtimer_init(struct hrtimer *timer,
+				enum hrtimer_restart (*function)(struct hrtimer *))
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(timer, function, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	timer->function = function;
+#endif
+}
+
+/*
+ * usb_alloc_urb() without iso packets, but on the node of the channel's
+ * buffers so completions don't touch remote memory. usb_free_urb() frees it.
+ */
+static struct urb *usb_rt_alloc_urb(struct usb_rt *dev, gfp_t mem_flags)
+{
+	struct urb *urb;
+
+	urb = kmalloc_node(sizeof(*urb), mem_flags, READ_ONCE(dev->numa_node));
+	if (urb)
+		usb_init_urb(urb);
+	return urb;
+}
+
+static void usb_rt_queue_event(struct usb_rt *dev, __u32 type, __s32 status,
+			       __u64 data)
+{
+	struct usb_rt_event event = {
+		.type = type,
+		.status = status,
+		.timestamp_ns = ktime_get_ns(),
+		.data = data,
+	};
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (kfifo_is_full(&dev->events))
+		kfifo_skip(&dev->events);
+	kfifo_put(&dev->events, event);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
 
 static void usb_rt_delete(struct kref *kref)
 {
 	struct usb_rt *dev = to_usb_rt_dev(kref);
 
 	kfree(dev->text_api_buffer);
-	usb_free_coherent(dev->bulk_in_urb->dev, dev->bulk_in_size,
-			  dev->bulk_in_buffer, dev->bulk_in_urb->transfer_dma);
+	kfifo_free(&dev->control);
+	usb_free_coherent(dev->udev, MAX_TRANSFER, dev->latest_bus.buf, dev->latest_bus.dma);
+	usb_free_coherent(dev->udev, MAX_TRANSFER, dev->latest_pending.buf, dev->latest_pending.dma);
+	usb_free_coherent(dev->udev, MAX_TRANSFER, dev->latest_fill.buf, dev->latest_fill.dma);
+	usb_free_urb(dev->latest_urb);
+	usb_free_coherent(dev->udev, MAX_TRANSFER, dev->coalesce_bus.buf, dev->coalesce_bus.dma);
+	usb_free_coherent(dev->udev, MAX_TRANSFER, dev->coalesce_fill.buf, dev->coalesce_fill.dma);
+	usb_free_urb(dev->coalesce_urb);
+	kfree(dev->coalesce_stage);
+	if (dev->bulk_in_urb)
+		usb_free_coherent(dev->bulk_in_urb->dev, dev->bulk_in_size,
+				  dev->bulk_in_buffer, dev->bulk_in_urb->transfer_dma);
 	usb_free_urb(dev->bulk_in_urb);
 	usb_put_intf(dev->interface);
 	usb_put_dev(dev->udev);
@@ -90,47 +496,144 @@ static void usb_rt_delete(struct kref *kref)
 static int usb_rt_open(struct inode *inode, struct file *file)
 {
 	struct usb_rt *dev;
-	struct usb_interface *interface;
+	struct usb_rt_file *f;
 	int subminor;
 	int retval = 0;
 
 	subminor = iminor(inode);
 
-	interface = usb_find_interface(&usb_rt_driver, subminor);
-	if (!interface) {
+	/* increment our usage count for the device */
+	mutex_lock(&usb_rt_minors_lock);
+	dev = subminor < USB_RT_MINORS ? usb_rt_minors[subminor] : NULL;
+	if (dev)
+		kref_get(&dev->kref);
+	mutex_unlock(&usb_rt_minors_lock);
+	if (!dev) {
 		pr_err("%s - error, can't find device for minor %d\n",
 			__func__, subminor);
 		retval = -ENODEV;
 		goto exit;
 	}
 
-	dev = usb_get_intfdata(interface);
-	if (!dev) {
-		retval = -ENODEV;
-		goto exit;
+	f = kzalloc_node(sizeof(*f), GFP_KERNEL, READ_ONCE(dev->numa_node));
+	if (!f) {
+		retval = -ENOMEM;
+		goto error;
 	}
+	mutex_init(&f->lock);
+	INIT_KFIFO(f->sg_done);
+	f->dev = dev;
 
-	retval = usb_autopm_get_interface(interface);
-	if (retval)
-		goto exit;
-
-	/* increment our usage count for the device */
-	kref_get(&dev->kref);
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval) {
+		kfree(f);
+		goto error;
+	}
 
 	/* save our object in the file's private structure */
-	file->private_data = dev;
+	file->private_data = f;
 
 exit:
 	return retval;
+
+error:
+	kref_put(&dev->kref, usb_rt_delete);
+	return retval;
+}
+
+/*
+ * The first realtime fd disables usb 3 link power management so that
+ * transfers after an idle gap do not pay U1/U2 exit latency. The device
+ * itself is kept out of autosuspend by the autopm reference of every open fd.
+ */
+static void usb_rt_realtime_get(struct usb_rt *dev)
+{
+	int retval;
+
+	mutex_lock(&dev->realtime_mutex);
+	/* usb 2.0 hardware lpm is a separate knob, see the udev rules */
+	if (dev->realtime_count++ == 0 && dev->udev->speed >= USB_SPEED_SUPER) {
+		retval = usb_unlocked_disable_lpm(dev->udev);
+		if (retval)
+			dev_warn(&dev->interface->dev,
+				 "%s - could not disable lpm, error %d\n",
+				 __func__, retval);
+		dev->lpm_disabled = !retval;
+	}
+	mutex_unlock(&dev->realtime_mutex);
+}
+
+static void usb_rt_realtime_put(struct usb_rt *dev)
+{
+	mutex_lock(&dev->realtime_mutex);
+	if (--dev->realtime_count == 0 && dev->lpm_disabled) {
+		usb_unlocked_enable_lpm(dev->udev);
+		dev->lpm_disabled = false;
+	}
+	mutex_unlock(&dev->realtime_mutex);
+}
+
+static void usb_rt_leave_realtime(struct usb_rt_file *f)
+{
+	if (!f->realtime)
+		return;
+
+	if (cpu_latency_qos_request_active(&f->qos))
+		cpu_latency_qos_remove_request(&f->qos);
+	usb_rt_realtime_put(f->dev);
+	f->realtime = false;
+}
+
+static int usb_rt_set_realtime(struct usb_rt_file *f,
+			       const struct usb_rt_realtime *rt)
+{
+	struct usb_rt *dev = f->dev;
+	int latency_us;
+
+	if (!rt->enable) {
+		usb_rt_leave_realtime(f);
+		return 0;
+	}
+
+	/* a negative bound selects the device default from sysfs */
+	latency_us = rt->cpu_latency_us < 0 ? READ_ONCE(dev->cpu_latency_us) :
+					      rt->cpu_latency_us;
+
+	if (latency_us < 0) {
+		if (cpu_latency_qos_request_active(&f->qos))
+			cpu_latency_qos_remove_request(&f->qos);
+	} else if (cpu_latency_qos_request_active(&f->qos)) {
+		cpu_latency_qos_update_request(&f->qos, latency_us);
+	} else {
+		cpu_latency_qos_add_request(&f->qos, latency_us);
+	}
+	if (!f->realtime)
+		usb_rt_realtime_get(dev);
+	f->realtime = true;
+
+	return 0;
 }
 
 static int usb_rt_release(struct inode *inode, struct file *file)
 {
+	struct usb_rt_file *f;
 	struct usb_rt *dev;
+	unsigned long flags;
+	bool busy;
 
-	dev = file->private_data;
-	if (dev == NULL)
+	f = file->private_data;
+	if (f == NULL)
 		return -ENODEV;
+	dev = f->dev;
+
+	usb_rt_leave_realtime(f);
+	/* after a fast close a zero copy write still on the bus frees f */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	f->released = true;
+	busy = f->sg_busy;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (!busy)
+		kfree(f);
 
 	/* allow the device to be autosuspended */
 	usb_autopm_put_interface(dev->interface);
@@ -142,17 +645,22 @@ static int usb_rt_release(struct inode *inode, struct file *file)
 
 static int usb_rt_flush(struct file *file, fl_owner_t id)
 {
+	struct usb_rt_file *f;
 	struct usb_rt *dev;
 	unsigned long flags;
 	int res;
 
-	dev = file->private_data;
-	if (dev == NULL)
+	f = file->private_data;
+	if (f == NULL)
 		return -ENODEV;
+	dev = f->dev;
 
-	/* wait for io to stop */
+	/* wait for io to stop, queued writes finish in the background on fast close */
 	mutex_lock(&dev->io_mutex);
-	usb_rt_draw_down(dev);
+	if (f->flags & USB_RT_FLAG_FAST_CLOSE)
+		usb_kill_urb(dev->bulk_in_urb);
+	else
+		usb_rt_draw_down(dev);
 
 	/* read out errors, leave subsequent opens a clean slate */
 	spin_lock_irqsave(&dev->err_lock, flags);
@@ -165,709 +673,4911 @@ static int usb_rt_flush(struct file *file, fl_owner_t id)
 	return res;
 }
 
-static void usb_rt_read_bulk_callback(struct urb *urb)
+static void usb_rt_latency_add(struct usb_rt_latency *latency, u64 ns)
 {
-	struct usb_rt *dev;
-	unsigned long flags;
+	latency->count++;
+	latency->total_ns += ns;
+	latency->max_ns = max(latency->max_ns, ns);
+}
 
-	dev = urb->context;
+static unsigned int usb_rt_latency_bucket(u64 us)
+{
+	unsigned int e;
 
-	spin_lock_irqsave(&dev->err_lock, flags);
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			dev_err(&dev->interface->dev,
-				"%s - nonzero read bulk status received: %d\n",
-				__func__, urb->status);
+	if (us < 4)
+		return us;
+	us = min_t(u64, us, (1 << 21) - 1);
+	e = fls64(us) - 1;
+	return 4 * (e - 1) + ((us >> (e - 2)) & 3);
+}
 
-		dev->errors = urb->status;
-	} else {
-		dev->bulk_in_filled = urb->actual_length;
-	}
-	dev->ongoing_read = 0;
-	spin_unlock_irqrestore(&dev->err_lock, flags);
+/* the upper limit in us of a latency bucket */
+static u64 usb_rt_bucket_limit(unsigned int bucket)
+{
+	unsigned int e = bucket / 4 + 1;
 
-	wake_up_interruptible(&dev->bulk_in_wait);
+	if (bucket < 4)
+		return bucket + 1;
+	return (u64)(5 + bucket % 4) << (e - 2);
 }
 
-static int usb_rt_do_read_io(struct usb_rt *dev, size_t count)
+/* called with err_lock held */
+static void usb_rt_adapt_timeout(struct usb_rt *dev)
 {
-	int rv;
-	unsigned long flags;
+	u64 target = DIV_ROUND_UP((u64)dev->latency_samples * dev->timeout_quantile, 1000);
+	u64 seen = 0;
+	u64 us;
+	int i;
 
-	/* prepare a read */
-	usb_fill_bulk_urb(dev->bulk_in_urb,
-			dev->udev,
-			usb_rcvbulkpipe(dev->udev,
-				dev->bulk_in_endpointAddr),
-			dev->bulk_in_buffer,
-			min(dev->bulk_in_size, count),
-			usb_rt_read_bulk_callback,
-			dev);
-	/* tell everybody to leave the URB alone */
-	spin_lock_irqsave(&dev->err_lock, flags);
-	dev->ongoing_read = 1;
-	spin_unlock_irqrestore(&dev->err_lock, flags);
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += dev->latency_hist[i];
+		if (seen >= target)
+			break;
+	}
 
-	/* submit bulk in urb, which means no data to deliver */
-	dev->bulk_in_filled = 0;
-	dev->bulk_in_copied = 0;
+	us = div_u64(usb_rt_bucket_limit(i) * dev->timeout_multiple, 100);
+	us = min_t(u64, us, dev->timeout_max_ms * USEC_PER_MSEC);
+	us = max_t(u64, us, dev->timeout_min_ms * USEC_PER_MSEC);
+	if (us != dev->timeout_effective_us) {
+		dev->timeout_effective_us = us;
+		dev->timeout_adjustments++;
+	}
+}
 
-	/* do it */
-	rv = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
-	if (rv < 0) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting read urb, error %d\n",
-			__func__, rv);
-		rv = (rv == -ENOMEM) ? rv : -EIO;
-		spin_lock_irqsave(&dev->err_lock, flags);
-		dev->ongoing_read = 0;
-		spin_unlock_irqrestore(&dev->err_lock, flags);
+/* called with err_lock held */
+static void usb_rt_latency_sample(struct usb_rt *dev, u64 latency_ns)
+{
+	int i;
+
+	dev->latency_hist[usb_rt_latency_bucket(div_u64(latency_ns, NSEC_PER_USEC))]++;
+	if (++dev->latency_samples >= LATENCY_WINDOW) {
+		/* age out old samples so the timeout follows current conditions */
+		dev->latency_samples = 0;
+		for (i = 0; i < LATENCY_BUCKETS; i++) {
+			dev->latency_hist[i] /= 2;
+			dev->latency_samples += dev->latency_hist[i];
+		}
 	}
 
-	return rv;
+	if (dev->timeout_adaptive && dev->latency_samples >= LATENCY_MIN_SAMPLES &&
+	    !(dev->latency_samples % 16))
+		usb_rt_adapt_timeout(dev);
 }
 
-unsigned int usb_rt_poll(struct file *file, struct poll_table_struct *wait) {
-	struct usb_rt *dev;
-	bool ongoing_io;
-	unsigned long flags;
-	unsigned int retval =  POLLWRNORM | POLLPRI | POLLOUT;	// can always write
-	int rv;
+static unsigned long usb_rt_read_timeout(struct usb_rt *dev)
+{
+	unsigned int us = READ_ONCE(dev->timeout_effective_us);
 
-	dev = file->private_data;
-	
-	rv = mutex_lock_interruptible(&dev->io_mutex);
-	if (rv < 0) {
-		return rv;
-	}
+	if (dev->timeout_adaptive && us)
+		return usecs_to_jiffies(us);
+	return msecs_to_jiffies(dev->timeout_ms);
+}
 
-	if (dev->disconnected) {		/* disconnect() was called */
-		retval = -ENODEV;
-		goto exit;
-	}
+/* called with err_lock held */
+static void usb_rt_account_sample(struct usb_rt *dev, struct usb_rt_read_sample *sample)
+{
+	if (sample->idle)
+		usb_rt_latency_add(&dev->read_latency_idle, sample->latency_ns);
+	else
+		usb_rt_latency_add(&dev->read_latency, sample->latency_ns);
+	usb_rt_latency_sample(dev, sample->latency_ns);
+}
 
-	poll_wait(file, &dev->bulk_in_wait, wait);
+/*
+ * called with err_lock held on read completion. Only the timing is taken
+ * here when a completion worker is set up, the statistics are left to it.
+ */
+static void usb_rt_account_read(struct usb_rt *dev)
+{
+	ktime_t now = ktime_get();
+	struct usb_rt_read_sample sample = {
+		.latency_ns = ktime_to_ns(ktime_sub(now, dev->bulk_in_submitted)),
+		.idle = ktime_us_delta(dev->bulk_in_submitted,
+				       dev->bulk_in_completed) > IDLE_GAP_US,
+	};
 
-	spin_lock_irqsave(&dev->err_lock, flags);
-	ongoing_io = dev->ongoing_read;
-	spin_unlock_irqrestore(&dev->err_lock, flags);
-	if(ongoing_io) {
-		// only return default retval
-	} else if (dev->errors) {
-		dev_info(&dev->interface->dev, "poll error: %d", dev->errors);
-		retval = POLLERR;
-		goto exit;
+	dev->bulk_in_completed = now;
+	if (dev->completion_worker) {
+		if (!kfifo_put(&dev->read_samples, sample))
+			dev->read_samples_dropped++;
+		kthread_queue_work(dev->completion_worker, &dev->completion_work);
 	} else {
-		if (dev->bulk_in_filled - dev->bulk_in_copied) {
-			// data is available
-			retval |= POLLRDNORM | POLLIN;
-		} else {
-			// todo else poll maybe triggers a new read
-			rv = usb_rt_do_read_io(dev, dev->bulk_in_size);
-			if (rv) {
-				retval = POLLERR;
+		usb_rt_account_sample(dev, &sample);
+	}
+}
+
+/*
+ * Move completion work to a kthread bound to cpu with the given SCHED_FIFO
+ * priority, or back inline for a negative cpu.
+ */
+static int usb_rt_set_completion(struct usb_rt *dev, int cpu, unsigned int priority)
+{
+	struct sched_attr attr = {
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = priority,
+	};
+	struct kthread_worker *worker = NULL, *old;
+	unsigned long flags;
+	int retval = 0;
+
+	mutex_lock(&dev->completion_mutex);
+	old = dev->completion_worker;
+	if (cpu >= 0) {
+		worker = old;
+		if (!worker) {
+			worker = kthread_create_worker(0, "usb_rt/%s.%u",
+						       dev_name(&dev->interface->dev),
+						       dev->channel);
+			if (IS_ERR(worker)) {
+				retval = PTR_ERR(worker);
 				goto exit;
 			}
 		}
+		retval = set_cpus_allowed_ptr(worker->task, cpumask_of(cpu));
+		if (!retval) {
+			if (priority)
+				retval = sched_setattr_nocheck(worker->task, &attr);
+			else
+				sched_set_normal(worker->task, 0);
+		}
+		if (retval) {
+			if (worker != old)
+				kthread_destroy_worker(worker);
+			goto exit;
+		}
+		if (worker != old) {
+			/*
+			 * since 6.14 kthread_create_worker() leaves the thread
+			 * asleep, before it ran already and the wakeup is harmless
+			 */
+			wake_up_process(worker->task);
+			/* the work may still point at a destroyed worker */
+			kthread_init_work(&dev->completion_work, usb_rt_completion_work);
+		}
 	}
 
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->completion_worker = worker;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	/* this runs the work still queued */
+	if (old && old != worker)
+		kthread_destroy_worker(old);
+
+	dev->completion_cpu = cpu < 0 ? -1 : cpu;
+	dev->completion_priority = priority;
 exit:
-	mutex_unlock(&dev->io_mutex);
+	mutex_unlock(&dev->completion_mutex);
 	return retval;
 }
 
-static ssize_t usb_rt_read(struct file *file, char *buffer, size_t count,
-			 loff_t *ppos)
+/* waits for the completion work queued so far */
+static void usb_rt_flush_completion(struct usb_rt *dev)
 {
-	struct usb_rt *dev;
-	int rv;
-	bool ongoing_io;
-	unsigned long flags;
+	mutex_lock(&dev->completion_mutex);
+	if (dev->completion_worker)
+		kthread_flush_work(&dev->completion_work);
+	mutex_unlock(&dev->completion_mutex);
+}
 
-	dev = file->private_data;
+/* kills the read, a reply already left to the completion worker is delivered */
+static void usb_rt_kill_read(struct usb_rt *dev)
+{
+	usb_kill_urb(dev->bulk_in_urb);
+	usb_rt_flush_completion(dev);
+}
 
-	/* if we cannot read at all, return EOF */
-	if (!dev->bulk_in_urb || !count)
-		return 0;
+/* channels may use interrupt endpoints with the same semantics as bulk */
+static unsigned int usb_rt_in_pipe(struct usb_rt *dev)
+{
+	if (dev->bulk_in_interval)
+		return usb_rcvintpipe(dev->udev, dev->bulk_in_endpointAddr);
+	return usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr);
+}
 
-	/* no concurrent readers */
-	rv = mutex_lock_interruptible(&dev->io_mutex);
-	if (rv < 0)
-		return rv;
+static unsigned int usb_rt_out_pipe(struct usb_rt *dev)
+{
+	if (dev->bulk_out_interval)
+		return usb_sndintpipe(dev->udev, dev->bulk_out_endpointAddr);
+	return usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr);
+}
 
-	if (dev->disconnected) {		/* disconnect() was called */
-		rv = -ENODEV;
-		goto exit;
-	}
+static void usb_rt_fill_in_urb(struct usb_rt *dev, struct urb *urb, void *buf,
+			       int len, usb_complete_t complete)
+{
+	if (dev->bulk_in_interval)
+		usb_fill_int_urb(urb, dev->udev, usb_rt_in_pipe(dev), buf, len,
+				 complete, dev, dev->bulk_in_interval);
+	else
+		usb_fill_bulk_urb(urb, dev->udev, usb_rt_in_pipe(dev), buf, len,
+				  complete, dev);
+}
+
+static void usb_rt_fill_out_urb(struct usb_rt *dev, struct urb *urb, void *buf,
+				int len, usb_complete_t complete)
+{
+	if (dev->bulk_out_interval)
+		usb_fill_int_urb(urb, dev->udev, usb_rt_out_pipe(dev), buf, len,
+				 complete, dev, dev->bulk_out_interval);
+	else
+		usb_fill_bulk_urb(urb, dev->udev, usb_rt_out_pipe(dev), buf, len,
+				  complete, dev);
+}
+
+/* called with err_lock held when an endpoint reports a stall */
+static void usb_rt_halted(struct usb_rt *dev, bool *halted)
+{
+	if (!dev->in_halted && !dev->out_halted)
+		dev->stall_start = ktime_get();
+	*halted = true;
+	/* usb_rt_remove_channel() has cancelled stall_work for good */
+	if (!dev->disconnected)
+		schedule_work(&dev->stall_work);
+}
+
+static void usb_rt_stall_work(struct work_struct *work)
+{
+	struct usb_rt *dev = container_of(work, struct usb_rt, stall_work);
+	unsigned long flags;
+	bool in_halted, out_halted;
+	ktime_t start;
+	int rv;
 
-	/* if IO is under way, we must not touch things */
-retry:
 	spin_lock_irqsave(&dev->err_lock, flags);
-	ongoing_io = dev->ongoing_read;
+	if (dev->disconnected) {
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	}
+	/* in_halted stays set until the read is back on the bus */
+	in_halted = dev->in_halted;
+	out_halted = dev->out_halted;
+	start = dev->stall_start;
+	dev->out_halted = false;
 	spin_unlock_irqrestore(&dev->err_lock, flags);
 
-	if (ongoing_io) {
-		/* nonblocking IO shall not wait */
-		if (file->f_flags & O_NONBLOCK) {
-			rv = -EAGAIN;
-			goto exit;
-		}
-		/*
-		 * IO may take forever
-		 * hence wait in an interruptible state
-		 */
-		rv = wait_event_interruptible_timeout(dev->bulk_in_wait, (!dev->ongoing_read), msecs_to_jiffies(dev->timeout_ms));
-		if (rv <= 0) {
-			if (rv == 0) {
-				rv = -ETIMEDOUT;
-			}
-			goto exit;
-		}
+	if (!in_halted && !out_halted)
+		return;
+
+	/* stream urbs still queued behind the stall go back to stream_idle */
+	if (in_halted) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->stream_held = true;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		usb_kill_anchored_urbs(&dev->stream_submitted);
 	}
 
-	/* errors must be reported */
-	rv = dev->errors;
-	if (rv < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		rv = (rv == -EPIPE) ? rv : -EIO;
-		/* report it */
-		goto exit;
+	rv = usb_autopm_get_interface(dev->interface);
+	if (!rv) {
+		if (out_halted)
+			rv = usb_clear_halt(dev->udev, usb_rt_out_pipe(dev));
+		if (!rv && in_halted)
+			rv = usb_clear_halt(dev->udev, dev->bulk_in_urb->pipe);
+		usb_autopm_put_interface(dev->interface);
 	}
 
 	/*
-	 * if the buffer is filled we may satisfy the read
-	 * else we need to start IO
+	 * disconnect kills the read after setting disconnected under err_lock,
+	 * a read abandoned while halted is not resubmitted
 	 */
+	if (in_halted) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->in_halted = false;
+		if (rv) {
+			/* reported below */
+		} else if (dev->disconnected) {
+			rv = -ENODEV;
+		} else if (dev->ongoing_read) {
+			dev->bulk_in_submitted = ktime_get();
+			rv = usb_submit_urb(dev->bulk_in_urb, GFP_ATOMIC);
+		}
+		/* after a failed recovery stream_read() refills once it reported it */
+		dev->stream_held = false;
+		if (!rv)
+			usb_rt_stream_fill(dev);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+	}
 
-	if (dev->bulk_in_filled) {
-		/* we had read data */
-		size_t available = dev->bulk_in_filled - dev->bulk_in_copied;
-		size_t chunk = min(available, count);
+	if (rv) {
+		dev_err(&dev->interface->dev,
+			"%s - stall recovery failed, error %d\n",
+			__func__, rv);
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->errors = -EPIPE;
+		if (in_halted)
+			dev->ongoing_read = 0;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		wake_up_interruptible(&dev->bulk_in_wait);
+	} else {
+		dev->stall_recoveries++;
+	}
 
-		if (!available) {
-			/*
-			 * all data has been used
-			 * actual IO needs to be done
-			 */
-			rv = usb_rt_do_read_io(dev, count);
-			if (rv < 0)
-				goto exit;
-			else
-				goto retry;
-		}
-		/*
-		 * data is available
-		 * chunk tells us how much shall be copied
-		 */
+	usb_rt_queue_event(dev, USB_RT_EVENT_STALL, rv,
+			   ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
 
-		if (copy_to_user(buffer,
-				 dev->bulk_in_buffer + dev->bulk_in_copied,
-				 chunk))
-			rv = -EFAULT;
-		else
-			rv = chunk;
+/* called from read completions, concurrently for different devices */
+static void usb_rt_ring_publish(struct usb_rt_ring *ring, struct usb_rt *dev,
+				u16 flags, int status, const void *data,
+				unsigned int len)
+{
+	u64 index = atomic64_fetch_inc(&ring->head);
+	struct usb_rt_record *record = &ring->records[index & (USB_RT_RING_RECORDS - 1)];
 
-		dev->bulk_in_copied += chunk;
+	/* a reader seeing seq 0 knows the record is being written */
+	WRITE_ONCE(record->seq, 0);
+	smp_wmb();
+	record->timestamp_ns = ktime_get_ns();
+	record->minor = dev->minor;
+	record->dev_seq = dev->ring_seq++;
+	record->flags = flags | (len > USB_RT_RECORD_DATA ? USB_RT_RECORD_TRUNCATED : 0);
+	record->status = status;
+	record->len = min_t(unsigned int, len, USB_RT_RECORD_DATA);
+	memcpy(record->data, data, record->len);
+	smp_store_release(&record->seq, index + 1);
 
-		/*
-		 * if we are asked for more than we have,
-		 * we start IO but don't wait
-		 */
-		// usb_rt only returns what it gets in one packet
-		// if (available < count)
-		// 	usb_rt_do_read_io(dev, count - chunk);
+	wake_up_interruptible(&ring->wait);
+}
+
+/* called from read completions or the completion worker */
+static void usb_rt_group_reply(struct usb_rt_group *group, struct usb_rt *dev,
+			       int status, const void *data, unsigned int len)
+{
+	struct usb_rt_group_member *m = &group->members[dev->group_member];
+	unsigned long flags;
+
+	spin_lock_irqsave(&group->lock, flags);
+	if (!m->pending) {
+		group->unexpected++;
 	} else {
-		/* no data in the buffer */
-		rv = usb_rt_do_read_io(dev, count);
-		if (rv < 0)
-			goto exit;
-		else
-			goto retry;
+		m->pending = false;
+		m->status = status;
+		m->len = min(len, m->size);
+		memcpy(m->data, data, m->len);
+		m->reply_ns = ktime_get_ns() - group->start_ns;
+		if (!--group->pending)
+			wake_up_interruptible(&group->wait);
 	}
-exit:
-	mutex_unlock(&dev->io_mutex);
-	return rv;
+	spin_unlock_irqrestore(&group->lock, flags);
 }
 
-static void usb_rt_write_bulk_callback(struct urb *urb)
+/*
+ * Called with err_lock held, keeps the read of an enrolled device on the
+ * bus. When that fails the ring gets a stopped record and group cycles fail
+ * the member at once, the device is read again after enrolling it again.
+ */
+static bool usb_rt_enrolled_resubmit(struct usb_rt *dev)
 {
-	struct usb_rt *dev;
-	unsigned long flags;
+	dev->bulk_in_submitted = ktime_get();
+	dev->errors = usb_submit_urb(dev->bulk_in_urb, GFP_ATOMIC);
+	if (!dev->errors)
+		return true;
+	if (dev->ring)
+		usb_rt_ring_publish(dev->ring, dev,
+				    USB_RT_RECORD_ERROR | USB_RT_RECORD_STOPPED,
+				    dev->errors, NULL, 0);
+	return false;
+}
 
-	dev = urb->context;
+/* IEEE 754 single to fixed point with 16 fraction bits, without the fpu */
+static s64 usb_rt_float_to_q16(u32 bits)
+{
+	int exp = (bits >> 23) & 0xff;
+	int shift = exp - 127 - 23 + 16;
+	s64 mag = (bits & 0x7fffff) | 0x800000;
 
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			dev_err(&dev->interface->dev,
-				"%s - nonzero write bulk status received: %d\n",
-				__func__, urb->status);
+	/* zero and denormals are below the resolution */
+	if (!exp)
+		return 0;
+	if (exp == 0xff || shift > 22)
+		mag = TAP_Q16_MAX;
+	else if (shift >= 0)
+		mag <<= shift;
+	else
+		mag = shift < -24 ? 0 : mag >> -shift;
+	return bits & 0x80000000 ? -mag : mag;
+}
 
-		spin_lock_irqsave(&dev->err_lock, flags);
-		dev->errors = urb->status;
-		spin_unlock_irqrestore(&dev->err_lock, flags);
-	}
+/* maps float bits to an unsigned key that sorts like the floats */
+static u32 usb_rt_float_key(u32 bits)
+{
+	return bits & 0x80000000 ? ~bits : bits | 0x80000000;
+}
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+/* called with tap_lock held */
+static void usb_rt_tap_result(struct usb_rt_tap *tap)
+{
+	if (tap->ready)
+		tap->overwritten++;
+	tap->ready = true;
+	wake_up_interruptible(&tap->wait);
 }
 
-static ssize_t usb_rt_write(struct file *file, const char *user_buffer,
-			  size_t count, loff_t *ppos)
+/* called with tap_lock held */
+static void usb_rt_tap_close_window(struct usb_rt_tap *tap, u64 now)
 {
-	struct usb_rt *dev;
-	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	unsigned long flags;
-	size_t writesize = min(count, (size_t)MAX_TRANSFER);
+	struct usb_rt_tap_window *window = (struct usb_rt_tap_window *)tap->buf;
+	unsigned int i;
+
+	window->start_ns = tap->start_ns;
+	window->end_ns = now;
+	window->packets = tap->count;
+	window->fields = tap->nfields;
+	for (i = 0; i < tap->nfields; i++) {
+		window->field[i].min = tap->min[i];
+		window->field[i].max = tap->max[i];
+		window->field[i].mean_q16 = div_s64(tap->sum[i], tap->count);
+	}
+	tap->len = struct_size(window, field, tap->nfields);
+	tap->count = 0;
+	usb_rt_tap_result(tap);
+}
 
-	dev = file->private_data;
+/* called with tap_lock held */
+static void usb_rt_tap_aggregate(struct usb_rt_tap *tap, const u8 *data,
+				 unsigned int len, u64 now)
+{
+	unsigned int i;
+	u32 bits;
 
-	//dev_info(&dev->interface->dev, "count write: %ld", count);
+	/* packets that don't hold all fields, e.g. control packets, are skipped */
+	for (i = 0; i < tap->nfields; i++)
+		if (tap->fields[i] + 4 > len)
+			return;
 
-	/* verify that we actually have some data to write */
-	if (count == 0)
-		goto exit;
+	if (tap->interval_ns && tap->count && now - tap->start_ns >= tap->interval_ns)
+		usb_rt_tap_close_window(tap, now);
 
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (!(file->f_flags & O_NONBLOCK)) {
-		if (down_interruptible(&dev->limit_sem)) {
-			retval = -ERESTARTSYS;
-			goto exit;
-		}
-	} else {
-		if (down_trylock(&dev->limit_sem)) {
-			retval = -EAGAIN;
-			goto exit;
+	for (i = 0; i < tap->nfields; i++) {
+		bits = get_unaligned_le32(data + tap->fields[i]);
+		if (!tap->count) {
+			tap->min[i] = bits;
+			tap->max[i] = bits;
+			tap->sum[i] = 0;
+		} else if (usb_rt_float_key(bits) < usb_rt_float_key(tap->min[i])) {
+			tap->min[i] = bits;
+		} else if (usb_rt_float_key(bits) > usb_rt_float_key(tap->max[i])) {
+			tap->max[i] = bits;
 		}
+		tap->sum[i] += usb_rt_float_to_q16(bits);
 	}
+	if (!tap->count++)
+		tap->start_ns = now;
 
-	spin_lock_irqsave(&dev->err_lock, flags);
-	retval = dev->errors;
-	if (retval < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		retval = (retval == -EPIPE) ? retval : -EIO;
-	}
-	spin_unlock_irqrestore(&dev->err_lock, flags);
-	if (retval < 0)
-		goto error;
+	if (tap->count == tap->every || tap->count == TAP_WINDOW_MAX)
+		usb_rt_tap_close_window(tap, now);
+}
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
+/* called for every packet a device receives */
+static void usb_rt_tap_feed(struct usb_rt *dev, const u8 *data, unsigned int len)
+{
+	struct usb_rt_tap *tap;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
 
-	buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+	spin_lock_irqsave(&dev->tap_lock, flags);
+	list_for_each_entry(tap, &dev->taps, node) {
+		if (tap->nfields) {
+			usb_rt_tap_aggregate(tap, data, len, now);
+			continue;
+		}
+		if (tap->every && ++tap->count < tap->every)
+			continue;
+		if (tap->interval_ns && tap->start_ns &&
+		    now - tap->start_ns < tap->interval_ns)
+			continue;
+		tap->count = 0;
+		tap->start_ns = now;
+		tap->len = min(len, tap->size);
+		memcpy(tap->buf, data, tap->len);
+		usb_rt_tap_result(tap);
 	}
+	spin_unlock_irqrestore(&dev->tap_lock, flags);
+}
 
-	if (copy_from_user(buf, user_buffer, writesize)) {
-		retval = -EFAULT;
-		goto error;
-	}
+/*
+ * The firmware prefixes control packets (timeout requests, long packet
+ * headers, notifications) with a 0 byte, see text_api_show(). With
+ * control_split they are queued for USB_RT_IOC_GET_CONTROL and readers only
+ * get data packets. The continuations of a long packet follow its header
+ * without the 0 byte and are queued as well, until total_length is in. A
+ * new control packet or a failed read ends a long packet whose rest was
+ * lost, packets without payload aren't continuations. A timeout request
+ * gives the read in flight that much more time.
+ * Called with err_lock held, true if the packet was taken.
+ */
+static bool usb_rt_control_packet(struct usb_rt *dev, const u8 *data,
+				  unsigned int len)
+{
+	struct usb_rt_control header = { 0 };
+	unsigned int size, total, payload;
 
-	/* this lock makes sure we don't submit URBs to gone devices */
-	mutex_lock(&dev->io_mutex);
-	if (dev->disconnected) {		/* disconnect() was called */
-		mutex_unlock(&dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+	if (!dev->control_split)
+		return false;
 
-	/* initialize the urb properly */
-	usb_fill_bulk_urb(urb, dev->udev,
-			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-			  buf, writesize, usb_rt_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &dev->submitted);
+	payload = len > CONTROL_HEADER ? len - CONTROL_HEADER : 0;
+	if (dev->control_long_left && payload && data[0] != 0) {
+		dev->control_long_left -= min(dev->control_long_left, payload);
+		header.flags = USB_RT_CONTROL_CONTINUATION;
+	} else if (len < 2 || data[0] != 0) {
+		return false;
+	} else {
+		dev->control_long_left = 0;
+		if (data[1] == CONTROL_LONG && len >= CONTROL_HEADER) {
+			/* text_api_show() rejects longer ones, they are not followed */
+			total = get_unaligned_le16(data + 4);
+			if (total <= PAGE_SIZE - CONTROL_HEADER && total > payload)
+				dev->control_long_left = total - payload;
+		} else if (data[1] == CONTROL_TIMEOUT && len == CONTROL_HEADER) {
+			dev->read_extend_us = get_unaligned_le32(data + 4);
+		}
+	}
 
-	/* send the data out the bulk port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&dev->io_mutex);
-	if (retval) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting write urb, error %d\n",
-			__func__, retval);
-		goto error_unanchor;
+	size = min_t(unsigned int, len, USB_RT_CONTROL_DATA);
+	if (kfifo_avail(&dev->control) < offsetof(struct usb_rt_control, data) + size) {
+		dev->control_dropped++;
+		return true;
 	}
+	header.timestamp_ns = ktime_get_ns();
+	header.len = size;
+	header.flags |= len > size ? USB_RT_CONTROL_TRUNCATED : 0;
+	kfifo_in(&dev->control, &header, offsetof(struct usb_rt_control, data));
+	kfifo_in(&dev->control, data, size);
+	return true;
+}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
+static void usb_rt_read_bulk_callback(struct urb *urb)
+{
+	struct usb_rt *dev;
+	unsigned long flags;
 
+	dev = urb->context;
 
-	return writesize;
+	spin_lock_irqsave(&dev->err_lock, flags);
+	/* a killed, stalled or failed read may have lost part of a long packet */
+	if (urb->status)
+		dev->control_long_left = 0;
+	/* a read killed by suspend or reset stays pending until rearmed */
+	if (dev->rearm_read && (urb->status == -ENOENT ||
+				urb->status == -ECONNRESET)) {
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	}
+	/* a stalled read stays pending and is resubmitted by stall_work */
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->in_halted);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	}
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err_ratelimited(&dev->interface->dev,
+					    "%s - nonzero read bulk status received: %d\n",
+					    __func__, urb->status);
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+		if (!(dev->ring || dev->group)) {
+			dev->errors = urb->status;
+		} else if (urb->status == -ENOENT || urb->status == -ECONNRESET ||
+			   urb->status == -ESHUTDOWN || urb->status == -ENODEV ||
+			   ++dev->enrolled_errors >= ENROLLED_ERRORS_MAX) {
+			/* killed by detach, gone with the device or failing for good */
+			dev->errors = urb->status;
+			if (dev->ring)
+				usb_rt_ring_publish(dev->ring, dev,
+						    USB_RT_RECORD_ERROR | USB_RT_RECORD_STOPPED,
+						    urb->status, NULL, 0);
+			else
+				usb_rt_group_reply(dev->group, dev, urb->status, NULL, 0);
+		} else {
+			/* enrolled devices report transient errors and keep reading */
+			if (dev->ring)
+				usb_rt_ring_publish(dev->ring, dev, USB_RT_RECORD_ERROR,
+						    urb->status, NULL, 0);
+			else
+				usb_rt_group_reply(dev->group, dev, urb->status, NULL, 0);
+			if (usb_rt_enrolled_resubmit(dev)) {
+				spin_unlock_irqrestore(&dev->err_lock, flags);
+				return;
+			}
+		}
+	} else if (usb_rt_control_packet(dev, dev->bulk_in_buffer, urb->actual_length)) {
+		/* keep reading for whoever waits for data, poll() sees POLLPRI */
+		dev->bulk_in_submitted = ktime_get();
+		dev->errors = usb_submit_urb(urb, GFP_ATOMIC);
+		if (!dev->errors) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			wake_up_interruptible(&dev->bulk_in_wait);
+			return;
+		}
+	} else if (dev->completion_worker && (dev->ring || dev->group)) {
+		/*
+		 * the worker copies the reply and resubmits, a plain read is
+		 * answered here so taps don't delay it
+		 */
+		dev->read_deferred = true;
+		dev->read_deferred_len = urb->actual_length;
+		usb_rt_account_read(dev);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	} else if (dev->ring || dev->group) {
+		usb_rt_tap_feed(dev, dev->bulk_in_buffer, urb->actual_length);
+		/* enrolled devices keep their read on the bus */
+		if (dev->ring)
+			usb_rt_ring_publish(dev->ring, dev, 0, 0, dev->bulk_in_buffer,
+					    urb->actual_length);
+		else
+			usb_rt_group_reply(dev->group, dev, 0, dev->bulk_in_buffer,
+					   urb->actual_length);
+		usb_rt_account_read(dev);
+		dev->enrolled_errors = 0;
+		if (usb_rt_enrolled_resubmit(dev)) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			return;
+		}
+	} else {
+		usb_rt_tap_feed(dev, dev->bulk_in_buffer, urb->actual_length);
+		dev->bulk_in_filled = urb->actual_length;
+		usb_rt_account_read(dev);
 	}
-	up(&dev->limit_sem);
+	dev->ongoing_read = 0;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
 
-exit:
-	return retval;
+	wake_up_interruptible(&dev->bulk_in_wait);
 }
 
-static const struct file_operations usb_rt_fops = {
-	.owner =	THIS_MODULE,
-	.read =		usb_rt_read,
-	.write =	usb_rt_write,
-	.open =		usb_rt_open,
-	.release =	usb_rt_release,
-	.flush =	usb_rt_flush,
-	.llseek =	noop_llseek,
-	.poll = 	usb_rt_poll,
-};
+/* called with err_lock held, drops the reply of an abandoned read */
+static void usb_rt_discard_read(struct usb_rt *dev)
+{
+	dev->bulk_in_filled = 0;
+	dev->bulk_in_copied = 0;
+	if (dev->errors == -ENOENT || dev->errors == -ECONNRESET)
+		dev->errors = 0;
+}
 
-static ssize_t text_api_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)		
+/*
+ * A read on a halted endpoint is not on the bus, so killing it does
+ * nothing. Ends it so stall_work only clears the halt.
+ * Called with err_lock held, true if the read was halted.
+ */
+static bool usb_rt_drop_halted_read(struct usb_rt *dev)
 {
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usb_rt *usb_rt = usb_get_intfdata(intf);	
-	int transfer_count = min(count, MAX_TRANSFER);
-	int count_sent = 0;
+	if (!dev->ongoing_read || !dev->in_halted)
+		return false;
+	dev->ongoing_read = 0;
+	usb_rt_discard_read(dev);
+	return true;
+}
+
+/* called with io_mutex held when a read times out */
+static void usb_rt_read_timedout(struct usb_rt *dev, unsigned int fflags)
+{
+	unsigned long flags;
+	bool halted;
+
+	if (fflags & USB_RT_FLAG_READ_UNLINK) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		halted = usb_rt_drop_halted_read(dev);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		if (!halted)
+			usb_rt_kill_read(dev);
+		spin_lock_irqsave(&dev->err_lock, flags);
+		usb_rt_discard_read(dev);
+		dev->reads_abandoned++;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+	} else if (fflags & USB_RT_FLAG_READ_DISCARD) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		/* the reply may have arrived since the wait ended */
+		if (dev->ongoing_read)
+			dev->read_stale = true;
+		else
+			usb_rt_discard_read(dev);
+		dev->reads_abandoned++;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+	}
+}
+
+/*
+ * Kill the read in flight, a reader waiting for it fails with ECANCELED.
+ * This can't take io_mutex, the reader it cancels holds it while waiting.
+ * Everything that changes who owns the read checks or sets its state
+ * under err_lock instead.
+ */
+static int usb_rt_cancel_read(struct usb_rt *dev)
+{
+	unsigned long flags;
+	bool ongoing, halted = false;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->disconnected) {
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return -ENODEV;
+	}
+	/* the read of enrolled devices belongs to the ring or group */
+	if (dev->ring || dev->group) {
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return -EBUSY;
+	}
+	ongoing = dev->ongoing_read;
+	if (ongoing) {
+		dev->read_cancelled = true;
+		halted = usb_rt_drop_halted_read(dev);
+	} else {
+		usb_rt_discard_read(dev);
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	if (halted)
+		wake_up_interruptible(&dev->bulk_in_wait);
+	else if (ongoing)
+		usb_kill_urb(dev->bulk_in_urb);
+	return 0;
+}
+
+static int usb_rt_do_read_io(struct usb_rt *dev, size_t count)
+{
+	int rv;
+	unsigned long flags;
+
+	/* prepare a read */
+	usb_rt_fill_in_urb(dev, dev->bulk_in_urb, dev->bulk_in_buffer,
+			   min(dev->bulk_in_size, count),
+			   usb_rt_read_bulk_callback);
+	/* tell everybody to leave the URB alone */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->ongoing_read = 1;
+	dev->read_extend_us = 0;
+	dev->bulk_in_submitted = ktime_get();
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* submit bulk in urb, which means no data to deliver */
+	dev->bulk_in_filled = 0;
+	dev->bulk_in_copied = 0;
+
+	/* do it */
+	rv = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
+	if (rv < 0) {
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting read urb, error %d\n",
+			__func__, rv);
+		rv = (rv == -ENOMEM) ? rv : -EIO;
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->ongoing_read = 0;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+	}
+
+	return rv;
+}
+
+/*
+ * The throughput receive mode keeps stream_urbs large reads on the bus that
+ * feed stream_ring, which read() drains. An urb is only submitted while the
+ * ring has room for it, otherwise it waits on stream_idle until read() makes
+ * room, so no data is dropped.
+ */
+
+/* called with err_lock held, submits idle stream urbs while there is room */
+static void usb_rt_stream_fill(struct usb_rt *dev)
+{
+	struct urb *urb;
+
+	while (dev->stream_enabled && !dev->stream_held &&
+	       kfifo_avail(&dev->stream_ring) >= dev->stream_reserved + dev->stream_urb_size) {
+		urb = usb_get_from_anchor(&dev->stream_idle);
+		if (!urb)
+			break;
+		usb_anchor_urb(urb, &dev->stream_submitted);
+		if (usb_submit_urb(urb, GFP_ATOMIC)) {
+			usb_unanchor_urb(urb);
+			usb_anchor_urb(urb, &dev->stream_idle);
+			usb_free_urb(urb);
+			break;
+		}
+		dev->stream_reserved += dev->stream_urb_size;
+		usb_free_urb(urb);
+	}
+}
+
+/* called with err_lock held, moves the data of a stream urb to stream_ring */
+static void usb_rt_stream_receive(struct usb_rt *dev, struct urb *urb)
+{
+	dev->stream_reserved -= dev->stream_urb_size;
+	kfifo_in(&dev->stream_ring, urb->transfer_buffer, urb->actual_length);
+	dev->stream_bytes += urb->actual_length;
+	usb_anchor_urb(urb, &dev->stream_idle);
+	usb_rt_stream_fill(dev);
+	if (usb_anchor_empty(&dev->stream_submitted))
+		dev->stream_stalls++;
+}
+
+static void usb_rt_stream_callback(struct urb *urb)
+{
+	struct usb_rt *dev = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (!urb->status && dev->completion_worker) {
+		/* the worker copies the data, its room stays reserved until then */
+		usb_anchor_urb(urb, &dev->stream_done);
+		kthread_queue_work(dev->completion_worker, &dev->completion_work);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	}
+	if (urb->status == -EPIPE) {
+		/* stall_work clears the halt and refills the stream urbs */
+		dev->stream_reserved -= dev->stream_urb_size;
+		usb_anchor_urb(urb, &dev->stream_idle);
+		usb_rt_halted(dev, &dev->in_halted);
+	} else if (urb->status) {
+		dev->stream_reserved -= dev->stream_urb_size;
+		/* sync/async unlink faults aren't errors */
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN)) {
+			dev_err(&dev->interface->dev,
+				"%s - nonzero stream status received: %d\n",
+				__func__, urb->status);
+			dev->errors = urb->status;
+		}
+		usb_anchor_urb(urb, &dev->stream_idle);
+	} else {
+		usb_rt_stream_receive(dev, urb);
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * Delivers a read reply the completion left to the worker. bulk_in_buffer
+ * is not on the bus until the read is resubmitted or ended here.
+ */
+static void usb_rt_deferred_read(struct usb_rt *dev)
+{
+	struct usb_rt_ring *ring;
+	struct usb_rt_group *group;
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (!dev->read_deferred) {
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		return;
+	}
+	/* usb_rt_detach() flushes the worker before ring or group go away */
+	ring = dev->ring;
+	group = dev->group;
+	len = dev->read_deferred_len;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	usb_rt_tap_feed(dev, dev->bulk_in_buffer, len);
+	if (ring)
+		usb_rt_ring_publish(ring, dev, 0, 0, dev->bulk_in_buffer, len);
+	else if (group)
+		usb_rt_group_reply(group, dev, 0, dev->bulk_in_buffer, len);
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->read_deferred = false;
+	if (dev->ring || dev->group) {
+		dev->enrolled_errors = 0;
+		/* usb_rt_rearm() resubmits a read held back by suspend or reset */
+		if (dev->rearm_read) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			return;
+		}
+		if (dev->disconnected) {
+			dev->errors = -ENODEV;
+		} else if (usb_rt_enrolled_resubmit(dev)) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			return;
+		}
+	} else {
+		dev->bulk_in_filled = len;
+	}
+	dev->ongoing_read = 0;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/* moves the data of stream urbs the completion left to the worker */
+static void usb_rt_deferred_stream(struct usb_rt *dev)
+{
+	unsigned long flags;
+	struct urb *urb;
+
+	urb = usb_get_from_anchor(&dev->stream_done);
+	if (!urb)
+		return;
+	do {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		usb_rt_stream_receive(dev, urb);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		usb_free_urb(urb);
+	} while ((urb = usb_get_from_anchor(&dev->stream_done)));
+
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * With a completion worker the completions only take the timing and leave
+ * the statistics and the copies of received data to taps, ring, group or
+ * stream_ring to this, which runs on completion_cpu.
+ */
+static void usb_rt_completion_work(struct kthread_work *work)
+{
+	struct usb_rt *dev = container_of(work, struct usb_rt, completion_work);
+	struct usb_rt_read_sample sample;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	while (kfifo_get(&dev->read_samples, &sample))
+		usb_rt_account_sample(dev, &sample);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	usb_rt_deferred_read(dev);
+	usb_rt_deferred_stream(dev);
+}
+
+/* called with io_mutex held */
+static void usb_rt_stream_stop(struct usb_rt *dev)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	if (!dev->stream_urb)
+		return;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->stream_enabled = false;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	usb_kill_anchored_urbs(&dev->stream_submitted);
+	usb_rt_flush_completion(dev);
+	usb_scuttle_anchored_urbs(&dev->stream_done);
+	usb_scuttle_anchored_urbs(&dev->stream_idle);
+	for (i = 0; i < dev->stream_urbs; i++) {
+		if (!dev->stream_urb[i])
+			continue;
+		usb_free_coherent(dev->udev, dev->stream_urb_size,
+				  dev->stream_urb[i]->transfer_buffer,
+				  dev->stream_urb[i]->transfer_dma);
+		usb_free_urb(dev->stream_urb[i]);
+	}
+	kfree(dev->stream_urb);
+	dev->stream_urb = NULL;
+	kfifo_free(&dev->stream_ring);
+	dev->stream_urbs = 0;
+	dev->stream_reserved = 0;
+	usb_rt_clear_kill_errors(dev);
+}
+
+/* called with io_mutex held */
+static int usb_rt_stream_start(struct usb_rt *dev, unsigned int urbs)
+{
+	int node = READ_ONCE(dev->numa_node);
+	unsigned long flags;
+	unsigned int i;
+	void *buf;
 	int retval;
 
-	memcpy(usb_rt->text_api_buffer, buf, transfer_count);	 // usb_bulk_msg doesn't want a pointer to const
+	/* the low latency read must not complete into the ring */
+	usb_rt_kill_read(dev);
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_discard_read(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
 
-	/* do an immediate bulk write to the device */
-	retval = usb_bulk_msg (usb_rt->udev,
-						usb_sndbulkpipe (usb_rt->udev,
-						0x01),
-						usb_rt->text_api_buffer,
-						transfer_count,
-						&count_sent, usb_rt->timeout_ms);
+	/* whole packets only, a short one ends a transfer */
+	dev->stream_urb_size = roundup(dev->stream_urb_size, dev->bulk_in_size);
+	retval = kfifo_alloc(&dev->stream_ring, dev->stream_ring_kb * 1024, GFP_KERNEL);
 	if (retval)
 		return retval;
-	else
-		return count_sent;		
+	if (kfifo_size(&dev->stream_ring) < dev->stream_urb_size) {
+		kfifo_free(&dev->stream_ring);
+		return -EINVAL;
+	}
+
+	dev->stream_urb = kcalloc_node(urbs, sizeof(*dev->stream_urb), GFP_KERNEL, node);
+	if (!dev->stream_urb) {
+		kfifo_free(&dev->stream_ring);
+		return -ENOMEM;
+	}
+	dev->stream_urbs = urbs;
+
+	for (i = 0; i < urbs; i++) {
+		dev->stream_urb[i] = usb_rt_alloc_urb(dev, GFP_KERNEL);
+		if (!dev->stream_urb[i])
+			goto error;
+		buf = usb_alloc_coherent(dev->udev, dev->stream_urb_size, GFP_KERNEL,
+					 &dev->stream_urb[i]->transfer_dma);
+		if (!buf) {
+			usb_free_urb(dev->stream_urb[i]);
+			dev->stream_urb[i] = NULL;
+			goto error;
+		}
+		usb_rt_fill_in_urb(dev, dev->stream_urb[i], buf, dev->stream_urb_size,
+				   usb_rt_stream_callback);
+		dev->stream_urb[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		usb_anchor_urb(dev->stream_urb[i], &dev->stream_idle);
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->stream_bytes = 0;
+	dev->stream_stalls = 0;
+	dev->stream_start = ktime_get();
+	dev->stream_enabled = true;
+	usb_rt_stream_fill(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	return 0;
+
+error:
+	usb_rt_stream_stop(dev);
+	return -ENOMEM;
 }
 
-static ssize_t text_api_show(struct device *dev, struct device_attribute *attr, char *buf)		
+/* called with io_mutex held */
+static ssize_t usb_rt_stream_read(struct usb_rt *dev, char __user *buffer,
+				  size_t count, bool nonblock)
 {
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usb_rt *usb_rt = usb_get_intfdata(intf);	
-	int count_received = 0;
-	/* do an immediate bulk read to get data from the device */
-	int retval = usb_bulk_msg (usb_rt->udev,
-						usb_rcvbulkpipe (usb_rt->udev,
-						0x81),
-						buf,
-						MAX_TRANSFER,
-						&count_received, usb_rt->timeout_ms);
-	if (retval)
-		return retval;
+	unsigned long flags;
+	unsigned int copied;
+	long rv;
+
+	while (kfifo_is_empty(&dev->stream_ring)) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		rv = dev->errors;
+		/* any error is reported once */
+		dev->errors = 0;
+		/* urbs that failed wait on stream_idle, retry them */
+		if (rv < 0)
+			usb_rt_stream_fill(dev);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		if (rv < 0)
+			return (rv == -EPIPE) ? rv : -EIO;
+
+		if (nonblock)
+			return -EAGAIN;
+		rv = wait_event_interruptible_timeout(dev->bulk_in_wait,
+				!kfifo_is_empty(&dev->stream_ring) || dev->errors,
+				usb_rt_read_timeout(dev));
+		if (rv == 0)
+			return -ETIMEDOUT;
+		if (rv < 0)
+			return rv;
+	}
+
+	if (kfifo_to_user(&dev->stream_ring, buffer, count, &copied))
+		return -EFAULT;
+
+	/* room was made, restart urbs that waited for it */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_stream_fill(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	return copied;
+}
+
+unsigned int usb_rt_poll(struct file *file, struct poll_table_struct *wait) {
+	struct usb_rt_file *f = file->private_data;
+	struct usb_rt *dev;
+	bool ongoing_io;
+	unsigned long flags;
+	unsigned int retval =  POLLWRNORM | POLLOUT;	// can always write
+	int rv;
+
+	dev = f->dev;
 	
-	if (count_received > 1) {
-		if (buf[0] == 0) {
-			// a control packet
-			if (buf[1] == 1) {
-				// timeout request
-				if (count_received == 8) {
-					// timeout request
-					// retriggers the read with the new timeout
-					uint32_t timeout_us = 0;
-					timeout_us = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
-					// dev_info(&intf->dev, "timeout request: %d\n", timeout_us);
-					retval = usb_bulk_msg (usb_rt->udev,
-									usb_rcvbulkpipe (usb_rt->udev,
-									0x81),
-									buf,
-									MAX_TRANSFER,
-									&count_received, timeout_us/1000 + usb_rt->timeout_ms);
-					if (retval)
-						return retval;
-				}
-			} else if (buf[1] == 2) {
-				// long packet
-				uint16_t total_length = buf[4] | (buf[5] << 8);
-				uint16_t packet_number = buf[6] | (buf[7] << 8);
-				const uint8_t header_size = 8;
-				uint16_t total_count_received = count_received - header_size;
-				if (total_length > PAGE_SIZE - header_size) {
-					// too long
-					return -EINVAL;
-				}
-				// dev_info(&intf->dev, "long packet: %d %d %d\n", total_length, packet_number, total_count_received);
-				memcpy(buf, buf + header_size, total_count_received);
-				while (total_length > total_count_received) {
-					// assemble multiple packets
-					char * new_buf = buf+total_count_received;
-					retval = usb_bulk_msg (usb_rt->udev,
-						usb_rcvbulkpipe (usb_rt->udev,
-						0x81),
-						new_buf,
-						MAX_TRANSFER,
-						&count_received, usb_rt->timeout_ms);
-					if (retval)
-						return retval;
-					total_count_received += count_received - header_size;
-					// dev_info(&intf->dev, "long packet2: %d %d %d\n", total_length, count_received, total_count_received);
-					memcpy(new_buf, new_buf+header_size, count_received-header_size);
-					// ignoring packet_number
-				}
-				count_received = total_count_received;
+	rv = mutex_lock_interruptible(&dev->io_mutex);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if (dev->disconnected) {		/* disconnect() was called */
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	poll_wait(file, &dev->bulk_in_wait, wait);
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	ongoing_io = dev->ongoing_read;
+	if (!kfifo_is_empty(&dev->events) || !kfifo_is_empty(&dev->control) ||
+	    !kfifo_is_empty(&f->sg_done))
+		retval |= POLLPRI;	// out of band event or control packet pending
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (dev->ring || dev->group) {
+		// data goes to the shared ring or group
+	} else if (dev->stream_urbs) {
+		// throughput mode, the stream urbs are always on the bus
+		if (!kfifo_is_empty(&dev->stream_ring))
+			retval |= POLLRDNORM | POLLIN;
+		else if (dev->errors)
+			retval = POLLERR;
+	} else if(ongoing_io) {
+		// only return default retval
+	} else if (dev->errors) {
+		dev_info(&dev->interface->dev, "poll error: %d", dev->errors);
+		retval = POLLERR;
+		goto exit;
+	} else {
+		if (dev->bulk_in_filled - dev->bulk_in_copied) {
+			// data is available
+			retval |= POLLRDNORM | POLLIN;
+		} else {
+			// todo else poll maybe triggers a new read
+			rv = usb_rt_do_read_io(dev, dev->bulk_in_size);
+			if (rv) {
+				retval = POLLERR;
+				goto exit;
+			}
+		}
+	}
+
+exit:
+	mutex_unlock(&dev->io_mutex);
+	return retval;
+}
+
+static ssize_t usb_rt_read(struct file *file, char *buffer, size_t count,
+			 loff_t *ppos)
+{
+	struct usb_rt_file *f = file->private_data;
+	struct usb_rt *dev;
+	int rv;
+	bool ongoing_io;
+	unsigned long flags;
+	unsigned long timeout;
+	u32 extend_us;
+
+	dev = f->dev;
+
+	/* if we cannot read at all, return EOF */
+	if (!dev->bulk_in_urb || !count)
+		return 0;
+
+	/* no concurrent readers */
+	rv = mutex_lock_interruptible(&dev->io_mutex);
+	if (rv < 0)
+		return rv;
+
+	if (dev->disconnected) {		/* disconnect() was called */
+		rv = -ENODEV;
+		goto exit;
+	}
+
+	if (dev->stream_urbs) {
+		rv = usb_rt_stream_read(dev, buffer, count, file->f_flags & O_NONBLOCK);
+		goto exit;
+	}
+
+	/* the data of enrolled devices goes to the shared ring or group */
+	if (dev->ring || dev->group) {
+		rv = -EBUSY;
+		goto exit;
+	}
+
+	/* if IO is under way, we must not touch things */
+retry:
+	spin_lock_irqsave(&dev->err_lock, flags);
+	ongoing_io = dev->ongoing_read;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	if (ongoing_io) {
+		/* nonblocking IO shall not wait */
+		if (file->f_flags & O_NONBLOCK) {
+			rv = -EAGAIN;
+			goto exit;
+		}
+		/*
+		 * IO may take forever
+		 * hence wait in an interruptible state
+		 */
+		timeout = usb_rt_read_timeout(dev);
+		while ((rv = wait_event_interruptible_timeout(dev->bulk_in_wait,
+				!dev->ongoing_read || READ_ONCE(dev->read_extend_us),
+				timeout)) > 0) {
+			/* a timeout request restarts the wait with its time added */
+			spin_lock_irqsave(&dev->err_lock, flags);
+			extend_us = dev->read_extend_us;
+			dev->read_extend_us = 0;
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			if (!extend_us)
+				break;
+			timeout = usecs_to_jiffies(extend_us) + usb_rt_read_timeout(dev);
+		}
+		if (rv <= 0) {
+			if (rv == 0) {
+				usb_rt_read_timedout(dev, READ_ONCE(f->flags));
+				rv = -ETIMEDOUT;
 			}
+			goto exit;
+		}
+	}
+
+	/* replies of cancelled or timed out reads are not returned */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->read_cancelled && !dev->ongoing_read) {
+		dev->read_cancelled = false;
+		usb_rt_discard_read(dev);
+		if (ongoing_io) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			rv = -ECANCELED;
+			goto exit;
+		}
+	}
+	if (dev->read_stale && !dev->ongoing_read) {
+		dev->read_stale = false;
+		usb_rt_discard_read(dev);
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* errors must be reported */
+	rv = dev->errors;
+	if (rv < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		/* to preserve notifications about reset */
+		rv = (rv == -EPIPE) ? rv : -EIO;
+		/* report it */
+		goto exit;
+	}
+
+	/*
+	 * if the buffer is filled we may satisfy the read
+	 * else we need to start IO
+	 */
+
+	if (dev->bulk_in_filled) {
+		/* we had read data */
+		size_t available = dev->bulk_in_filled - dev->bulk_in_copied;
+		size_t chunk = min(available, count);
+
+		if (!available) {
+			/*
+			 * all data has been used
+			 * actual IO needs to be done
+			 */
+			rv = usb_rt_do_read_io(dev, count);
+			if (rv < 0)
+				goto exit;
+			else
+				goto retry;
+		}
+		/*
+		 * data is available
+		 * chunk tells us how much shall be copied
+		 */
+
+		if (copy_to_user(buffer,
+				 dev->bulk_in_buffer + dev->bulk_in_copied,
+				 chunk))
+			rv = -EFAULT;
+		else
+			rv = chunk;
+
+		dev->bulk_in_copied += chunk;
+
+		/*
+		 * if we are asked for more than we have,
+		 * we start IO but don't wait
+		 */
+		// usb_rt only returns what it gets in one packet
+		// if (available < count)
+		// 	usb_rt_do_read_io(dev, count - chunk);
+	} else {
+		/* no data in the buffer */
+		rv = usb_rt_do_read_io(dev, count);
+		if (rv < 0)
+			goto exit;
+		else
+			goto retry;
+	}
+exit:
+	mutex_unlock(&dev->io_mutex);
+	return rv;
+}
+
+static void usb_rt_write_bulk_callback(struct urb *urb);
+static void usb_rt_write_priority_callback(struct urb *urb);
+
+/* called with err_lock held */
+static int usb_rt_submit_write(struct usb_rt *dev, struct urb *urb)
+{
+	int rv;
+
+	usb_anchor_urb(urb, &dev->submitted);
+	rv = usb_submit_urb(urb, GFP_ATOMIC);
+	if (rv)
+		usb_unanchor_urb(urb);
+	else
+		dev->out_busy++;
+	return rv;
+}
+
+/* give back the buffer and slot of a deferred write that is not sent */
+static void usb_rt_drop_deferred_write(struct usb_rt *dev, struct urb *urb)
+{
+	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+			  urb->transfer_buffer, urb->transfer_dma);
+	up(&dev->limit_sem);
+}
+
+/*
+ * usb_free_coherent() must not run with interrupts off, so writes that
+ * usb_rt_kick_writes() failed to submit under err_lock wait on
+ * write_failed until the caller has dropped the lock.
+ */
+static void usb_rt_free_failed_writes(struct usb_rt *dev)
+{
+	struct urb *urb;
+
+	while ((urb = usb_get_from_anchor(&dev->write_failed))) {
+		usb_rt_drop_deferred_write(dev, urb);
+		usb_free_urb(urb);
+	}
+}
+
+static void usb_rt_write_free_work(struct work_struct *work)
+{
+	struct usb_rt *dev = container_of(work, struct usb_rt, write_free_work);
+
+	usb_rt_free_failed_writes(dev);
+}
+
+/*
+ * Token bucket pacing of writes as a generic cell rate algorithm: a write
+ * conforms if it is no earlier than pace_burst - 1 intervals before its
+ * theoretical arrival time. Returns the ns until the next write conforms.
+ * Only normal and priority writes are paced, latest-wins, coalesced and sg
+ * writes have their own flow control and bypass the bucket.
+ * Called with err_lock held.
+ */
+static u64 usb_rt_pace_wait(struct usb_rt *dev, u64 now)
+{
+	u64 tolerance;
+
+	if (!dev->pace_rate)
+		return 0;
+	tolerance = div_u64(NSEC_PER_SEC, dev->pace_rate) * (dev->pace_burst - 1);
+	if (dev->pace_tat <= now + tolerance)
+		return 0;
+	return dev->pace_tat - tolerance - now;
+}
+
+/* called with err_lock held */
+static void usb_rt_pace_charge(struct usb_rt *dev, u64 now)
+{
+	if (!dev->pace_rate)
+		return;
+	dev->pace_tat = max(dev->pace_tat, now) +
+			div_u64(NSEC_PER_SEC, dev->pace_rate);
+}
+
+/* called with err_lock held */
+static void usb_rt_pace_arm(struct usb_rt *dev, u64 wait)
+{
+	if (hrtimer_is_queued(&dev->pace_timer))
+		return;
+	hrtimer_start(&dev->pace_timer, ns_to_ktime(wait), HRTIMER_MODE_REL);
+	dev->pace_waits++;
+}
+
+/*
+ * Normal writes beyond out_depth or pace_rate wait in the deferred anchor
+ * and are submitted as earlier writes complete or by pace_timer. Priority
+ * writes are never deferred, so they only wait for the writes already on
+ * the bus, but they use up pacing tokens.
+ * Called with err_lock held.
+ */
+static int usb_rt_queue_write(struct usb_rt *dev, struct urb *urb,
+			      bool priority)
+{
+	u64 now = ktime_get_ns();
+	u64 wait;
+
+	if (!priority) {
+		if (dev->out_busy >= dev->out_depth ||
+		    !usb_anchor_empty(&dev->deferred)) {
+			usb_anchor_urb(urb, &dev->deferred);
+			return 0;
+		}
+		wait = usb_rt_pace_wait(dev, now);
+		if (wait) {
+			usb_anchor_urb(urb, &dev->deferred);
+			usb_rt_pace_arm(dev, wait);
+			return 0;
+		}
+	}
+	usb_rt_pace_charge(dev, now);
+	return usb_rt_submit_write(dev, urb);
+}
+
+/*
+ * called with err_lock held, the caller runs usb_rt_free_failed_writes()
+ * after unlocking
+ */
+static void usb_rt_kick_writes(struct usb_rt *dev)
+{
+	struct urb *urb;
+	u64 now, wait;
+	int rv;
+
+	while (dev->out_busy < dev->out_depth) {
+		now = ktime_get_ns();
+		wait = usb_rt_pace_wait(dev, now);
+		if (wait) {
+			if (!usb_anchor_empty(&dev->deferred))
+				usb_rt_pace_arm(dev, wait);
+			break;
+		}
+		urb = usb_get_from_anchor(&dev->deferred);
+		if (!urb)
+			break;
+		usb_rt_pace_charge(dev, now);
+		rv = usb_rt_submit_write(dev, urb);
+		if (rv) {
+			dev->errors = rv;
+			usb_anchor_urb(urb, &dev->write_failed);
+		}
+		usb_free_urb(urb);
+	}
+}
+
+static enum hrtimer_restart usb_rt_pace_timer(struct hrtimer *timer)
+{
+	struct usb_rt *dev = container_of(timer, struct usb_rt, pace_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_kick_writes(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* hardirq context, the buffers are freed by write_free_work */
+	if (!usb_anchor_empty(&dev->write_failed))
+		schedule_work(&dev->write_free_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/* drop all deferred writes, returns how many were dropped */
+static int usb_rt_drop_deferred(struct usb_rt *dev)
+{
+	struct urb *urb;
+	int dropped = 0;
+
+	while ((urb = usb_get_from_anchor(&dev->deferred))) {
+		usb_rt_drop_deferred_write(dev, urb);
+		usb_free_urb(urb);
+		dropped++;
+	}
+	usb_rt_free_failed_writes(dev);
+	return dropped;
+}
+
+static void usb_rt_write_complete(struct urb *urb)
+{
+	struct usb_rt *dev;
+	unsigned long flags;
+
+	dev = urb->context;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	/* a stall drops this write, stall_work clears the endpoint */
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	/* sync/async unlink faults aren't errors */
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed++;
+	}
+	dev->out_busy--;
+	usb_rt_kick_writes(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	usb_rt_free_failed_writes(dev);
+
+	/* free up our allocated buffer */
+	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+			  urb->transfer_buffer, urb->transfer_dma);
+}
+
+static void usb_rt_write_bulk_callback(struct urb *urb)
+{
+	struct usb_rt *dev = urb->context;
+
+	usb_rt_write_complete(urb);
+	up(&dev->limit_sem);
+}
+
+static void usb_rt_write_priority_callback(struct urb *urb)
+{
+	struct usb_rt *dev = urb->context;
+
+	usb_rt_write_complete(urb);
+	up(&dev->prio_sem);
+}
+
+static void usb_rt_sg_free(struct usb_rt_sg_write_ctx *w)
+{
+	usb_free_urb(w->urb);
+	sg_free_table(&w->sgt);
+	if (w->nr_pages > 0)
+		unpin_user_pages(w->pages, w->nr_pages);
+	kvfree(w->pages);
+	kfree(w);
+}
+
+static void usb_rt_write_sg_callback(struct urb *urb)
+{
+	struct usb_rt_sg_write_ctx *w = urb->context;
+	struct usb_rt *dev = w->dev;
+	struct usb_rt_file *f = w->f;
+	struct usb_rt_event event = {
+		.type = USB_RT_EVENT_WRITE_DONE,
+		.status = urb->status,
+		.timestamp_ns = ktime_get_ns(),
+		.data = w->cookie,
+	};
+	unsigned long flags;
+	bool release = false;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	/* a stall drops this write, stall_work clears the endpoint */
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	/* sync/async unlink faults aren't errors */
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed++;
+	}
+	dev->out_busy--;
+	usb_rt_kick_writes(dev);
+	/* sg_pending reserved room in sg_done */
+	f->sg_busy--;
+	if (f->released)
+		release = !f->sg_busy;
+	else
+		kfifo_put(&f->sg_done, event);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	usb_rt_free_failed_writes(dev);
+
+	if (release)
+		kfree(f);
+	wake_up_interruptible(&dev->bulk_in_wait);
+	usb_rt_sg_free(w);
+	up(&dev->limit_sem);
+}
+
+/*
+ * Large writes are sent straight from the pinned user pages with a scatter
+ * gather urb. They are submitted right away, without pacing, and their
+ * completion is reported as an event on the fd. Each write holds a slot of
+ * the fd until that event is read, so it can't be lost to a full queue.
+ */
+static int usb_rt_write_sg(struct usb_rt_file *f, struct usb_rt_sg_write *req,
+			   bool nonblock)
+{
+	struct usb_rt *dev = f->dev;
+	struct usb_bus *bus = dev->udev->bus;
+	unsigned long start = req->buf;
+	unsigned int offset = offset_in_page(start);
+	struct usb_rt_sg_write_ctx *w;
+	unsigned long flags;
+	int nr_pages;
+	int retval;
+
+	if (!bus->sg_tablesize)
+		return -EOPNOTSUPP;
+	if (!req->len || req->len > SG_WRITE_MAX)
+		return -EINVAL;
+	/* only whole pages keep every sg entry a multiple of maxpacket */
+	if (!bus->no_sg_constraint && offset)
+		return -EINVAL;
+	nr_pages = DIV_ROUND_UP(offset + req->len, PAGE_SIZE);
+
+	if (!nonblock) {
+		if (down_interruptible(&dev->limit_sem))
+			return -ERESTARTSYS;
+	} else {
+		if (down_trylock(&dev->limit_sem))
+			return -EAGAIN;
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = dev->errors;
+	if (retval < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		/* to preserve notifications about reset */
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	} else if (f->sg_pending == SG_WRITES_QUEUED) {
+		retval = -EBUSY;
+	} else {
+		f->sg_pending++;
+		f->sg_busy++;
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (retval < 0)
+		goto error_sem;
+
+	w = kzalloc_node(sizeof(*w), GFP_KERNEL, READ_ONCE(dev->numa_node));
+	if (!w) {
+		retval = -ENOMEM;
+		goto error_slot;
+	}
+	w->dev = dev;
+	w->f = f;
+	w->cookie = req->cookie;
+
+	w->pages = kvmalloc_array(nr_pages, sizeof(*w->pages), GFP_KERNEL);
+	if (!w->pages) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	w->nr_pages = pin_user_pages_fast(start, nr_pages, 0, w->pages);
+	if (w->nr_pages != nr_pages) {
+		retval = w->nr_pages < 0 ? w->nr_pages : -EFAULT;
+		goto error;
+	}
+
+	retval = sg_alloc_table_from_pages(&w->sgt, w->pages, nr_pages, offset,
+					   req->len, GFP_KERNEL);
+	if (retval)
+		goto error;
+	if (w->sgt.orig_nents > bus->sg_tablesize) {
+		retval = -EINVAL;
+		goto error;
+	}
+
+	w->urb = usb_rt_alloc_urb(dev, GFP_KERNEL);
+	if (!w->urb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	usb_rt_fill_out_urb(dev, w->urb, NULL, req->len, usb_rt_write_sg_callback);
+	w->urb->context = w;
+	w->urb->sg = w->sgt.sgl;
+	w->urb->num_sgs = w->sgt.orig_nents;
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = usb_rt_submit_write(dev, w->urb);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		goto error;
+	}
+	return 0;
+
+error:
+	usb_rt_sg_free(w);
+error_slot:
+	spin_lock_irqsave(&dev->err_lock, flags);
+	f->sg_pending--;
+	f->sg_busy--;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+error_sem:
+	up(&dev->limit_sem);
+	return retval;
+}
+
+/* frees what a failed allocation left behind, so a retry starts over */
+static void usb_rt_wbufs_free(struct usb_rt *dev, struct usb_rt_wbuf **wbufs,
+			      int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		usb_free_coherent(dev->udev, MAX_TRANSFER, wbufs[i]->buf,
+				  wbufs[i]->dma);
+		wbufs[i]->buf = NULL;
+	}
+}
+
+/*
+ * Latest wins writes keep at most one command pending behind the one on the
+ * bus. A newer command replaces the pending one in place.
+ */
+static int usb_rt_latest_alloc(struct usb_rt *dev)
+{
+	struct usb_rt_wbuf *wbufs[] = {
+		&dev->latest_bus, &dev->latest_pending, &dev->latest_fill
+	};
+	int i;
+
+	mutex_lock(&dev->latest_mutex);
+	if (dev->latest_urb)
+		goto exit;
+
+	for (i = 0; i < ARRAY_SIZE(wbufs); i++) {
+		wbufs[i]->buf = usb_alloc_coherent(dev->udev, MAX_TRANSFER,
+						   GFP_KERNEL, &wbufs[i]->dma);
+		if (!wbufs[i]->buf)
+			goto error;
+	}
+
+	/* allocated last, it marks the buffers as ready */
+	dev->latest_urb = usb_rt_alloc_urb(dev, GFP_KERNEL);
+	if (!dev->latest_urb)
+		goto error;
+exit:
+	mutex_unlock(&dev->latest_mutex);
+	return 0;
+
+error:
+	usb_rt_wbufs_free(dev, wbufs, i);
+	mutex_unlock(&dev->latest_mutex);
+	return -ENOMEM;
+}
+
+static void usb_rt_write_latest_callback(struct urb *urb);
+
+/* called with err_lock held */
+static int usb_rt_submit_latest(struct usb_rt *dev, gfp_t mem_flags)
+{
+	struct urb *urb = dev->latest_urb;
+	int rv;
+
+	usb_rt_fill_out_urb(dev, urb, dev->latest_bus.buf, dev->latest_bus.len,
+			    usb_rt_write_latest_callback);
+	urb->transfer_dma = dev->latest_bus.dma;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_anchor_urb(urb, &dev->submitted);
+
+	rv = usb_submit_urb(urb, mem_flags);
+	if (rv)
+		usb_unanchor_urb(urb);
+	dev->latest_busy = !rv;
+	return rv;
+}
+
+static void usb_rt_write_latest_callback(struct urb *urb)
+{
+	struct usb_rt *dev = urb->context;
+	unsigned long flags;
+	int rv;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->latest_busy = false;
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed += 1 + dev->latest_valid;
+	} else if (dev->latest_valid) {
+		swap(dev->latest_bus, dev->latest_pending);
+		dev->latest_valid = false;
+		rv = usb_rt_submit_latest(dev, GFP_ATOMIC);
+		if (rv)
+			dev->errors = rv;
+	}
+	/* a pending command is stale after an error */
+	if (urb->status)
+		dev->latest_valid = false;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+}
+
+static ssize_t usb_rt_write_latest(struct usb_rt *dev,
+				   const char __user *user_buffer,
+				   size_t writesize)
+{
+	unsigned long flags;
+	int retval;
+
+	if (!dev->latest_urb)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&dev->latest_mutex))
+		return -ERESTARTSYS;
+
+	if (copy_from_user(dev->latest_fill.buf, user_buffer, writesize)) {
+		retval = -EFAULT;
+		goto exit;
+	}
+	dev->latest_fill.len = writesize;
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {		/* disconnect() was called */
+		retval = -ENODEV;
+		goto exit_io;
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = dev->errors;
+	if (retval < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		/* to preserve notifications about reset */
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	} else if (!dev->latest_busy) {
+		swap(dev->latest_bus, dev->latest_fill);
+		retval = usb_rt_submit_latest(dev, GFP_ATOMIC);
+		if (retval)
+			dev_err(&dev->interface->dev,
+				"%s - failed submitting write urb, error %d\n",
+				__func__, retval);
+	} else {
+		if (dev->latest_valid)
+			dev->writes_replaced++;
+		swap(dev->latest_pending, dev->latest_fill);
+		dev->latest_valid = true;
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+exit_io:
+	mutex_unlock(&dev->io_mutex);
+exit:
+	mutex_unlock(&dev->latest_mutex);
+	return retval ? retval : writesize;
+}
+
+/*
+ * Coalescing writes collect small writes into one transfer. Each write
+ * becomes a record of a little endian u16 length followed by the data. The
+ * transfer is sent coalesce_us after its first record or once it holds
+ * coalesce_bytes.
+ */
+static int usb_rt_coalesce_alloc(struct usb_rt *dev)
+{
+	struct usb_rt_wbuf *wbufs[] = { &dev->coalesce_bus, &dev->coalesce_fill };
+	int i = 0;
+
+	mutex_lock(&dev->coalesce_mutex);
+	if (dev->coalesce_urb)
+		goto exit;
+
+	dev->coalesce_stage = kmalloc_node(MAX_TRANSFER, GFP_KERNEL,
+					   READ_ONCE(dev->numa_node));
+	if (!dev->coalesce_stage)
+		goto error;
+
+	for (i = 0; i < ARRAY_SIZE(wbufs); i++) {
+		wbufs[i]->buf = usb_alloc_coherent(dev->udev, MAX_TRANSFER,
+						   GFP_KERNEL, &wbufs[i]->dma);
+		if (!wbufs[i]->buf)
+			goto error;
+	}
+
+	/* allocated last, it marks the buffers as ready */
+	dev->coalesce_urb = usb_rt_alloc_urb(dev, GFP_KERNEL);
+	if (!dev->coalesce_urb)
+		goto error;
+exit:
+	mutex_unlock(&dev->coalesce_mutex);
+	return 0;
+
+error:
+	/* a retry starts over instead of leaking what was allocated */
+	usb_rt_wbufs_free(dev, wbufs, i);
+	kfree(dev->coalesce_stage);
+	dev->coalesce_stage = NULL;
+	mutex_unlock(&dev->coalesce_mutex);
+	return -ENOMEM;
+}
+
+static void usb_rt_write_coalesce_callback(struct urb *urb);
+
+/* send the collected records, called with err_lock held */
+static void usb_rt_coalesce_flush(struct usb_rt *dev)
+{
+	struct urb *urb = dev->coalesce_urb;
+	int rv;
+
+	if (dev->coalesce_busy) {
+		dev->coalesce_flush = true;
+		return;
+	}
+	dev->coalesce_flush = false;
+	if (!dev->coalesce_fill.len)
+		return;
+	hrtimer_try_to_cancel(&dev->coalesce_timer);
+
+	swap(dev->coalesce_bus, dev->coalesce_fill);
+	dev->writes_coalesced += dev->coalesce_records;
+	dev->coalesced_transfers++;
+	dev->coalesce_fill.len = 0;
+	dev->coalesce_records = 0;
+
+	usb_rt_fill_out_urb(dev, urb, dev->coalesce_bus.buf, dev->coalesce_bus.len,
+			    usb_rt_write_coalesce_callback);
+	urb->transfer_dma = dev->coalesce_bus.dma;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_anchor_urb(urb, &dev->submitted);
+
+	rv = usb_submit_urb(urb, GFP_ATOMIC);
+	if (rv) {
+		usb_unanchor_urb(urb);
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, rv);
+		dev->errors = rv;
+	}
+	dev->coalesce_busy = !rv;
+}
+
+static enum hrtimer_restart usb_rt_coalesce_timer(struct hrtimer *timer)
+{
+	struct usb_rt *dev = container_of(timer, struct usb_rt, coalesce_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_coalesce_flush(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void usb_rt_write_coalesce_callback(struct urb *urb)
+{
+	struct usb_rt *dev = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->coalesce_busy = false;
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed++;
+	}
+	if (dev->coalesce_flush)
+		usb_rt_coalesce_flush(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	wake_up_interruptible(&dev->coalesce_wait);
+}
+
+/* drop collected records, returns how many were dropped */
+static int usb_rt_coalesce_drop(struct usb_rt *dev)
+{
+	unsigned long flags;
+	int dropped;
+
+	hrtimer_cancel(&dev->coalesce_timer);
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dropped = dev->coalesce_records;
+	dev->coalesce_fill.len = 0;
+	dev->coalesce_records = 0;
+	dev->coalesce_flush = false;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	return dropped;
+}
+
+static ssize_t usb_rt_write_coalesce(struct usb_rt *dev,
+				     const char __user *user_buffer,
+				     size_t writesize, bool nonblock)
+{
+	size_t record = COALESCE_HEADER + writesize;
+	unsigned long flags;
+	int retval;
+
+	if (!dev->coalesce_urb)
+		return -EINVAL;
+	if (record > MAX_TRANSFER)
+		return -EMSGSIZE;
+
+	if (mutex_lock_interruptible(&dev->coalesce_mutex))
+		return -ERESTARTSYS;
+
+	if (copy_from_user(dev->coalesce_stage, user_buffer, writesize)) {
+		retval = -EFAULT;
+		goto exit;
+	}
+
+retry:
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {		/* disconnect() was called */
+		retval = -ENODEV;
+		goto exit_io;
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = dev->errors;
+	if (retval < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		/* to preserve notifications about reset */
+		retval = (retval == -EPIPE) ? retval : -EIO;
+		goto exit_lock;
+	}
+
+	/* send what was collected and wait for the urb if the record doesn't fit */
+	if (dev->coalesce_fill.len + record > MAX_TRANSFER) {
+		usb_rt_coalesce_flush(dev);
+		if (dev->coalesce_busy) {
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+			mutex_unlock(&dev->io_mutex);
+			if (nonblock)
+				retval = -EAGAIN;
+			else
+				retval = wait_event_interruptible(dev->coalesce_wait,
+								  !dev->coalesce_busy);
+			if (retval)
+				goto exit;
+			goto retry;
+		}
+	}
+
+	dev->coalesce_fill.buf[dev->coalesce_fill.len] = writesize & 0xff;
+	dev->coalesce_fill.buf[dev->coalesce_fill.len + 1] = writesize >> 8;
+	memcpy(dev->coalesce_fill.buf + dev->coalesce_fill.len + COALESCE_HEADER,
+	       dev->coalesce_stage, writesize);
+	dev->coalesce_fill.len += record;
+	dev->coalesce_records++;
+
+	if (dev->coalesce_fill.len >= dev->coalesce_bytes)
+		usb_rt_coalesce_flush(dev);
+	else if (dev->coalesce_records == 1)
+		hrtimer_start(&dev->coalesce_timer,
+			      ns_to_ktime((u64)dev->coalesce_us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+
+exit_lock:
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+exit_io:
+	mutex_unlock(&dev->io_mutex);
+exit:
+	mutex_unlock(&dev->coalesce_mutex);
+	return retval ? retval : writesize;
+}
+
+static ssize_t usb_rt_write(struct file *file, const char *user_buffer,
+			  size_t count, loff_t *ppos)
+{
+	struct usb_rt_file *f = file->private_data;
+	struct usb_rt *dev;
+	struct semaphore *sem;
+	bool priority = f->flags & USB_RT_FLAG_PRIORITY;
+	int retval = 0;
+	struct urb *urb = NULL;
+	char *buf = NULL;
+	unsigned long flags;
+	size_t writesize;
+
+	dev = f->dev;
+	writesize = min(count, READ_ONCE(dev->max_transfer));
+
+	//dev_info(&dev->interface->dev, "count write: %ld", count);
+
+	/* verify that we actually have some data to write */
+	if (count == 0)
+		goto exit;
+
+	if (f->flags & USB_RT_FLAG_LATEST_WINS)
+		return usb_rt_write_latest(dev, user_buffer, writesize);
+	if (f->flags & USB_RT_FLAG_COALESCE)
+		return usb_rt_write_coalesce(dev, user_buffer, writesize,
+					     file->f_flags & O_NONBLOCK);
+
+	/*
+	 * limit the number of URBs in flight to stop a user from using up all
+	 * RAM, priority writes have their own reserved slots
+	 */
+	sem = priority ? &dev->prio_sem : &dev->limit_sem;
+	if (!(file->f_flags & O_NONBLOCK)) {
+		if (down_interruptible(sem)) {
+			retval = -ERESTARTSYS;
+			goto exit;
+		}
+	} else {
+		if (down_trylock(sem)) {
+			retval = -EAGAIN;
+			goto exit;
+		}
+	}
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = dev->errors;
+	if (retval < 0) {
+		/* any error is reported once */
+		dev->errors = 0;
+		/* to preserve notifications about reset */
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (retval < 0)
+		goto error;
+
+	/* create a urb, and a buffer for it, and copy the data to the urb */
+	urb = usb_rt_alloc_urb(dev, GFP_KERNEL);
+	if (!urb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
+				 &urb->transfer_dma);
+	if (!buf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	if (copy_from_user(buf, user_buffer, writesize)) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	/* initialize the urb properly */
+	usb_rt_fill_out_urb(dev, urb, buf, writesize,
+			    priority ? usb_rt_write_priority_callback :
+				       usb_rt_write_bulk_callback);
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	/* send the data out the bulk port or queue it behind earlier writes */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	retval = usb_rt_queue_write(dev, urb, priority);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		goto error;
+	}
+
+	/*
+	 * release our reference to this urb, the USB core will eventually free
+	 * it entirely
+	 */
+	usb_free_urb(urb);
+
+
+	return writesize;
+
+error:
+	if (urb) {
+		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	up(sem);
+
+exit:
+	return retval;
+}
+
+/* wakes tap readers of a device that is going away */
+static void usb_rt_tap_hangup(struct usb_rt *dev)
+{
+	struct usb_rt_tap *tap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->tap_lock, flags);
+	list_for_each_entry(tap, &dev->taps, node)
+		wake_up_interruptible(&tap->wait);
+	spin_unlock_irqrestore(&dev->tap_lock, flags);
+}
+
+static int usb_rt_tap_release(struct inode *inode, struct file *file)
+{
+	struct usb_rt_tap *tap = file->private_data;
+	struct usb_rt *dev = tap->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	spin_lock(&dev->tap_lock);
+	list_del(&tap->node);
+	dev->ntaps--;
+	spin_unlock(&dev->tap_lock);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	kfree(tap->buf);
+	kfree(tap->out);
+	kfree(tap);
+	kref_put(&dev->kref, usb_rt_delete);
+	return 0;
+}
+
+static ssize_t usb_rt_tap_read(struct file *file, char __user *buffer,
+			       size_t count, loff_t *ppos)
+{
+	struct usb_rt_tap *tap = file->private_data;
+	struct usb_rt *dev = tap->dev;
+	unsigned long flags;
+	unsigned int len;
+	int rv;
+
+	if (mutex_lock_interruptible(&tap->lock))
+		return -ERESTARTSYS;
+
+	if (!(file->f_flags & O_NONBLOCK)) {
+		rv = wait_event_interruptible(tap->wait, READ_ONCE(tap->ready) ||
+					      READ_ONCE(dev->disconnected));
+		if (rv < 0)
+			goto exit;
+	}
+
+	spin_lock_irqsave(&dev->tap_lock, flags);
+	len = tap->ready ? min_t(size_t, tap->len, count) : 0;
+	memcpy(tap->out, tap->buf, len);
+	tap->ready = false;
+	spin_unlock_irqrestore(&dev->tap_lock, flags);
+
+	if (!len)
+		rv = dev->disconnected ? -ENODEV : -EAGAIN;
+	else
+		rv = copy_to_user(buffer, tap->out, len) ? -EFAULT : len;
+exit:
+	mutex_unlock(&tap->lock);
+	return rv;
+}
+
+static __poll_t usb_rt_tap_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct usb_rt_tap *tap = file->private_data;
+
+	poll_wait(file, &tap->wait, wait);
+	if (READ_ONCE(tap->ready))
+		return EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(tap->dev->disconnected))
+		return EPOLLHUP;
+	return 0;
+}
+
+static const struct file_operations usb_rt_tap_fops = {
+	.owner =	THIS_MODULE,
+	.read =		usb_rt_tap_read,
+	.poll =		usb_rt_tap_poll,
+	.release =	usb_rt_tap_release,
+	.llseek =	noop_llseek,
+};
+
+static int usb_rt_tap_create(struct usb_rt *dev, struct usb_rt_tap_config *cfg)
+{
+	struct usb_rt_tap *tap;
+	unsigned long flags;
+	unsigned int i;
+	int fd;
+
+	/* exactly one of every and interval_us */
+	if (!cfg->every == !cfg->interval_us || cfg->nfields > USB_RT_TAP_FIELDS ||
+	    cfg->every > TAP_WINDOW_MAX)
+		return -EINVAL;
+	for (i = 0; i < cfg->nfields; i++)
+		if (cfg->fields[i] + 4 > dev->bulk_in_size)
+			return -EINVAL;
+
+	tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+	if (!tap)
+		return -ENOMEM;
+	tap->dev = dev;
+	init_waitqueue_head(&tap->wait);
+	mutex_init(&tap->lock);
+	tap->every = cfg->every;
+	tap->interval_ns = (u64)cfg->interval_us * NSEC_PER_USEC;
+	tap->nfields = cfg->nfields;
+	memcpy(tap->fields, cfg->fields, sizeof(tap->fields));
+	tap->size = cfg->nfields ?
+		sizeof(struct usb_rt_tap_window) +
+		cfg->nfields * sizeof(struct usb_rt_tap_field) :
+		dev->bulk_in_size;
+	tap->buf = kmalloc(tap->size, GFP_KERNEL);
+	tap->out = kmalloc(tap->size, GFP_KERNEL);
+	if (!tap->buf || !tap->out) {
+		fd = -ENOMEM;
+		goto error;
+	}
+
+	/* release() of the new fd may run as soon as it is installed */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	spin_lock(&dev->tap_lock);
+	if (dev->ntaps == TAP_MAX) {
+		spin_unlock(&dev->tap_lock);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		fd = -EBUSY;
+		goto error;
+	}
+	list_add_tail(&tap->node, &dev->taps);
+	dev->ntaps++;
+	spin_unlock(&dev->tap_lock);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	kref_get(&dev->kref);
+
+	fd = anon_inode_getfd("[usb_rt_tap]", &usb_rt_tap_fops, tap,
+			      O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		spin_lock(&dev->tap_lock);
+		list_del(&tap->node);
+		dev->ntaps--;
+		spin_unlock(&dev->tap_lock);
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		kref_put(&dev->kref, usb_rt_delete);
+		goto error;
+	}
+	return fd;
+
+error:
+	kfree(tap->buf);
+	kfree(tap->out);
+	kfree(tap);
+	return fd;
+}
+
+static long usb_rt_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct usb_rt_file *f = file->private_data;
+	void __user *argp = (void __user *)arg;
+	long retval;
+
+	mutex_lock(&f->lock);
+	switch (cmd) {
+	case USB_RT_IOC_SET_REALTIME: {
+		struct usb_rt_realtime rt;
+
+		if (copy_from_user(&rt, argp, sizeof(rt))) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = usb_rt_set_realtime(f, &rt);
+		break;
+	}
+	case USB_RT_IOC_GET_EVENT: {
+		struct usb_rt_event event;
+		unsigned long flags;
+
+		spin_lock_irqsave(&f->dev->err_lock, flags);
+		/* completions of zero copy writes first, reading one frees its slot */
+		if (kfifo_get(&f->sg_done, &event)) {
+			f->sg_pending--;
+			retval = 0;
+		} else {
+			retval = kfifo_get(&f->dev->events, &event) ? 0 : -EAGAIN;
+		}
+		spin_unlock_irqrestore(&f->dev->err_lock, flags);
+		if (!retval && copy_to_user(argp, &event, sizeof(event)))
+			retval = -EFAULT;
+		break;
+	}
+	case USB_RT_IOC_SET_FLAGS: {
+		__u32 flags;
+
+		if (get_user(flags, (__u32 __user *)argp)) {
+			retval = -EFAULT;
+			break;
+		}
+		if (flags & ~USB_RT_FLAGS_ALL) {
+			retval = -EINVAL;
+			break;
+		}
+		/* usb_rt_write() would silently pick one of them */
+		if (hweight32(flags & (USB_RT_FLAG_LATEST_WINS | USB_RT_FLAG_PRIORITY |
+				       USB_RT_FLAG_COALESCE)) > 1) {
+			retval = -EINVAL;
+			break;
+		}
+		retval = 0;
+		if (flags & USB_RT_FLAG_LATEST_WINS)
+			retval = usb_rt_latest_alloc(f->dev);
+		if (!retval && (flags & USB_RT_FLAG_COALESCE))
+			retval = usb_rt_coalesce_alloc(f->dev);
+		if (!retval)
+			f->flags = flags;
+		break;
+	}
+	case USB_RT_IOC_GET_FLAGS:
+		retval = put_user(f->flags, (__u32 __user *)argp);
+		break;
+	case USB_RT_IOC_CANCEL_WRITES:
+		retval = usb_rt_cancel_writes(f->dev);
+		break;
+	case USB_RT_IOC_WRITE_SG: {
+		struct usb_rt_sg_write req;
+
+		if (copy_from_user(&req, argp, sizeof(req))) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = usb_rt_write_sg(f, &req, file->f_flags & O_NONBLOCK);
+		break;
+	}
+	case USB_RT_IOC_CANCEL_READ:
+		retval = f->dev->bulk_in_urb ? usb_rt_cancel_read(f->dev) : 0;
+		break;
+	case USB_RT_IOC_GET_CONTROL: {
+		struct usb_rt_control control;
+		unsigned long flags;
+		size_t header = offsetof(struct usb_rt_control, data);
+
+		spin_lock_irqsave(&f->dev->err_lock, flags);
+		retval = kfifo_out(&f->dev->control, &control, header) ? 0 : -EAGAIN;
+		if (!retval)
+			retval = kfifo_out(&f->dev->control, control.data, control.len);
+		spin_unlock_irqrestore(&f->dev->err_lock, flags);
+		if (retval >= 0)
+			retval = copy_to_user(argp, &control, header + control.len) ?
+				 -EFAULT : 0;
+		break;
+	}
+	case USB_RT_IOC_TAP: {
+		struct usb_rt_tap_config cfg;
+
+		if (copy_from_user(&cfg, argp, sizeof(cfg))) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = usb_rt_tap_create(f->dev, &cfg);
+		break;
+	}
+	default:
+		retval = -ENOTTY;
+		break;
+	}
+	mutex_unlock(&f->lock);
+
+	return retval;
+}
+
+static const struct file_operations usb_rt_fops = {
+	.owner =	THIS_MODULE,
+	.read =		usb_rt_read,
+	.write =	usb_rt_write,
+	.open =		usb_rt_open,
+	.release =	usb_rt_release,
+	.flush =	usb_rt_flush,
+	.llseek =	noop_llseek,
+	.poll = 	usb_rt_poll,
+	.unlocked_ioctl = usb_rt_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+};
+
+/*
+ * The first channel of an interface has its attributes on the interface,
+ * further channels on their char device node.
+ */
+static struct usb_rt *usb_rt_from_dev(struct device *dev)
+{
+	if (dev->class == usb_rt_class)
+		return dev_get_drvdata(dev);
+	return usb_get_intfdata(to_usb_interface(dev));
+}
+
+static ssize_t text_api_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)		
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	int transfer_count = min(count, MAX_TRANSFER);
+	int count_sent = 0;
+	int retval;
+
+	memcpy(usb_rt->text_api_buffer, buf, transfer_count);	 // usb_bulk_msg doesn't want a pointer to const
+
+	/* do an immediate bulk write to the device */
+	retval = usb_bulk_msg (usb_rt->udev,
+						usb_sndbulkpipe (usb_rt->udev,
+						0x01),
+						usb_rt->text_api_buffer,
+						transfer_count,
+						&count_sent, usb_rt->timeout_ms);
+	if (retval)
+		return retval;
+	else
+		return count_sent;		
+}
+
+static ssize_t text_api_show(struct device *dev, struct device_attribute *attr, char *buf)		
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	int count_received = 0;
+	/* do an immediate bulk read to get data from the device */
+	int retval = usb_bulk_msg (usb_rt->udev,
+						usb_rcvbulkpipe (usb_rt->udev,
+						0x81),
+						buf,
+						MAX_TRANSFER,
+						&count_received, usb_rt->timeout_ms);
+	if (retval)
+		return retval;
+	
+	if (count_received > 1) {
+		if (buf[0] == 0) {
+			// a control packet
+			if (buf[1] == 1) {
+				// timeout request
+				if (count_received == 8) {
+					// timeout request
+					// retriggers the read with the new timeout
+					uint32_t timeout_us = 0;
+					timeout_us = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+					// dev_info(&intf->dev, "timeout request: %d\n", timeout_us);
+					retval = usb_bulk_msg (usb_rt->udev,
+									usb_rcvbulkpipe (usb_rt->udev,
+									0x81),
+									buf,
+									MAX_TRANSFER,
+									&count_received, timeout_us/1000 + usb_rt->timeout_ms);
+					if (retval)
+						return retval;
+				}
+			} else if (buf[1] == 2) {
+				// long packet
+				uint16_t total_length = buf[4] | (buf[5] << 8);
+				uint16_t packet_number = buf[6] | (buf[7] << 8);
+				const uint8_t header_size = 8;
+				uint16_t total_count_received = count_received - header_size;
+				if (total_length > PAGE_SIZE - header_size) {
+					// too long
+					return -EINVAL;
+				}
+				// dev_info(&intf->dev, "long packet: %d %d %d\n", total_length, packet_number, total_count_received);
+				memcpy(buf, buf + header_size, total_count_received);
+				while (total_length > total_count_received) {
+					// assemble multiple packets
+					char * new_buf = buf+total_count_received;
+					retval = usb_bulk_msg (usb_rt->udev,
+						usb_rcvbulkpipe (usb_rt->udev,
+						0x81),
+						new_buf,
+						MAX_TRANSFER,
+						&count_received, usb_rt->timeout_ms);
+					if (retval)
+						return retval;
+					total_count_received += count_received - header_size;
+					// dev_info(&intf->dev, "long packet2: %d %d %d\n", total_length, count_received, total_count_received);
+					memcpy(new_buf, new_buf+header_size, count_received-header_size);
+					// ignoring packet_number
+				}
+				count_received = total_count_received;
+			}
+		}
+	} // else always fall back to just returning the data
+	return count_received;
+}
+struct device_attribute dev_attr_text_api = __ATTR_RW(text_api);
+
+static ssize_t timeout_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)		
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	sscanf(buf, "%d", &usb_rt->timeout_ms);
+	return count;	
+}
+
+static ssize_t timeout_ms_show(struct device *dev, struct device_attribute *attr, char *buf)		
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->timeout_ms);	
+}
+struct device_attribute dev_attr_timeout_ms = __ATTR_RW(timeout_ms);
+
+static ssize_t cpu_latency_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	int latency_us;
+	int retval;
+
+	retval = kstrtoint(buf, 0, &latency_us);
+	if (retval)
+		return retval;
+	WRITE_ONCE(usb_rt->cpu_latency_us, latency_us);
+	return count;
+}
+
+static ssize_t cpu_latency_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->cpu_latency_us);
+}
+struct device_attribute dev_attr_cpu_latency_us = __ATTR_RW(cpu_latency_us);
+
+/* latency attributes show count, mean and max in us, any write resets them */
+static ssize_t usb_rt_latency_show(struct usb_rt *usb_rt, struct usb_rt_latency *latency, char *buf)
+{
+	struct usb_rt_latency l;
+	unsigned long flags;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	l = *latency;
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+
+	return sysfs_emit(buf, "%llu %llu %llu\n", l.count,
+			  l.count ? div64_u64(l.total_ns, l.count) / NSEC_PER_USEC : 0,
+			  l.max_ns / NSEC_PER_USEC);
+}
+
+static void usb_rt_latency_reset(struct usb_rt *usb_rt, struct usb_rt_latency *latency)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	memset(latency, 0, sizeof(*latency));
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+}
+
+static ssize_t read_latency_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	usb_rt_latency_reset(usb_rt, &usb_rt->read_latency);
+	return count;
+}
+
+static ssize_t read_latency_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return usb_rt_latency_show(usb_rt, &usb_rt->read_latency, buf);
+}
+struct device_attribute dev_attr_read_latency = __ATTR_RW(read_latency);
+
+static ssize_t read_latency_idle_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	usb_rt_latency_reset(usb_rt, &usb_rt->read_latency_idle);
+	return count;
+}
+
+static ssize_t read_latency_idle_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return usb_rt_latency_show(usb_rt, &usb_rt->read_latency_idle, buf);
+}
+struct device_attribute dev_attr_read_latency_idle = __ATTR_RW(read_latency_idle);
+
+static ssize_t lpm_disabled_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->lpm_disabled);
+}
+struct device_attribute dev_attr_lpm_disabled = __ATTR_RO(lpm_disabled);
+
+static ssize_t stall_recoveries_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->stall_recoveries);
+}
+struct device_attribute dev_attr_stall_recoveries = __ATTR_RO(stall_recoveries);
+
+static ssize_t writes_replaced_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->writes_replaced);
+}
+struct device_attribute dev_attr_writes_replaced = __ATTR_RO(writes_replaced);
+
+static ssize_t write_depth_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int depth;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &depth);
+	if (retval)
+		return retval;
+	if (depth < 1 || depth > WRITES_IN_FLIGHT)
+		return -EINVAL;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->out_depth = depth;
+	usb_rt_kick_writes(usb_rt);
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	usb_rt_free_failed_writes(usb_rt);
+	return count;
+}
+
+static ssize_t write_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->out_depth);
+}
+struct device_attribute dev_attr_write_depth = __ATTR_RW(write_depth);
+
+static ssize_t coalesce_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int us;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &us);
+	if (retval)
+		return retval;
+	WRITE_ONCE(usb_rt->coalesce_us, us);
+	return count;
+}
+
+static ssize_t coalesce_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->coalesce_us);
+}
+struct device_attribute dev_attr_coalesce_us = __ATTR_RW(coalesce_us);
+
+static ssize_t coalesce_bytes_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int bytes;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &bytes);
+	if (retval)
+		return retval;
+	if (bytes < 1 || bytes > MAX_TRANSFER)
+		return -EINVAL;
+	WRITE_ONCE(usb_rt->coalesce_bytes, bytes);
+	return count;
+}
+
+static ssize_t coalesce_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->coalesce_bytes);
+}
+struct device_attribute dev_attr_coalesce_bytes = __ATTR_RW(coalesce_bytes);
+
+static ssize_t writes_coalesced_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->writes_coalesced);
+}
+struct device_attribute dev_attr_writes_coalesced = __ATTR_RO(writes_coalesced);
+
+static ssize_t coalesced_transfers_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->coalesced_transfers);
+}
+struct device_attribute dev_attr_coalesced_transfers = __ATTR_RO(coalesced_transfers);
+
+static ssize_t pace_rate_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int rate;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &rate);
+	if (retval)
+		return retval;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->pace_rate = rate;
+	usb_rt->pace_tat = 0;
+	usb_rt_kick_writes(usb_rt);
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	usb_rt_free_failed_writes(usb_rt);
+	return count;
+}
+
+static ssize_t pace_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->pace_rate);
+}
+struct device_attribute dev_attr_pace_rate = __ATTR_RW(pace_rate);
+
+static ssize_t pace_burst_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int burst;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &burst);
+	if (retval)
+		return retval;
+	if (burst < 1)
+		return -EINVAL;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->pace_burst = burst;
+	usb_rt_kick_writes(usb_rt);
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	usb_rt_free_failed_writes(usb_rt);
+	return count;
+}
+
+static ssize_t pace_burst_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->pace_burst);
+}
+struct device_attribute dev_attr_pace_burst = __ATTR_RW(pace_burst);
+
+static ssize_t pace_waits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->pace_waits);
+}
+struct device_attribute dev_attr_pace_waits = __ATTR_RO(pace_waits);
+
+static ssize_t timeout_adaptive_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	bool adaptive;
+	int retval;
+
+	retval = kstrtobool(buf, &adaptive);
+	if (retval)
+		return retval;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->timeout_adaptive = adaptive;
+	if (adaptive && usb_rt->latency_samples >= LATENCY_MIN_SAMPLES)
+		usb_rt_adapt_timeout(usb_rt);
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	return count;
+}
+
+static ssize_t timeout_adaptive_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->timeout_adaptive);
+}
+struct device_attribute dev_attr_timeout_adaptive = __ATTR_RW(timeout_adaptive);
+
+static ssize_t timeout_quantile_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &value);
+	if (retval)
+		return retval;
+	if (value < 1 || value > 1000)
+		return -EINVAL;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->timeout_quantile = value;
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	return count;
+}
+
+static ssize_t timeout_quantile_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_quantile);
+}
+struct device_attribute dev_attr_timeout_quantile = __ATTR_RW(timeout_quantile);
+
+static ssize_t timeout_multiple_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &value);
+	if (retval)
+		return retval;
+	if (value < 100 || value > 10000)
+		return -EINVAL;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	usb_rt->timeout_multiple = value;
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	return count;
+}
+
+static ssize_t timeout_multiple_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_multiple);
+}
+struct device_attribute dev_attr_timeout_multiple = __ATTR_RW(timeout_multiple);
+
+static ssize_t timeout_min_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &value);
+	if (retval)
+		return retval;
+	if (value < 1 || value > 60000)
+		return -EINVAL;
+
+	/* a crossed range would leave the clamp to whichever bound wins */
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	if (value > usb_rt->timeout_max_ms)
+		retval = -EINVAL;
+	else
+		usb_rt->timeout_min_ms = value;
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	return retval ? retval : count;
+}
+
+static ssize_t timeout_min_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_min_ms);
+}
+struct device_attribute dev_attr_timeout_min_ms = __ATTR_RW(timeout_min_ms);
+
+static ssize_t timeout_max_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &value);
+	if (retval)
+		return retval;
+	if (value < 1 || value > 60000)
+		return -EINVAL;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	if (value < usb_rt->timeout_min_ms)
+		retval = -EINVAL;
+	else
+		usb_rt->timeout_max_ms = value;
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	return retval ? retval : count;
+}
+
+static ssize_t timeout_max_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_max_ms);
+}
+struct device_attribute dev_attr_timeout_max_ms = __ATTR_RW(timeout_max_ms);
+
+static ssize_t timeout_effective_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_effective_us);
+}
+struct device_attribute dev_attr_timeout_effective_us = __ATTR_RO(timeout_effective_us);
+
+static ssize_t timeout_adjustments_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->timeout_adjustments);
+}
+struct device_attribute dev_attr_timeout_adjustments = __ATTR_RO(timeout_adjustments);
+
+static ssize_t max_transfer_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int bytes;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &bytes);
+	if (retval)
+		return retval;
+	if (bytes < 1 || bytes > MAX_TRANSFER)
+		return -EINVAL;
+
+	WRITE_ONCE(usb_rt->max_transfer, bytes);
+	return count;
+}
+
+static ssize_t max_transfer_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%zu\n", usb_rt->max_transfer);
+}
+struct device_attribute dev_attr_max_transfer = __ATTR_RW(max_transfer);
+
+/* -1 for no preference */
+static ssize_t numa_node_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	int node;
+	int retval;
+
+	retval = kstrtoint(buf, 0, &node);
+	if (retval)
+		return retval;
+	if (node != NUMA_NO_NODE &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return -EINVAL;
+
+	WRITE_ONCE(usb_rt->numa_node, node);
+	return count;
+}
+
+static ssize_t numa_node_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->numa_node);
+}
+struct device_attribute dev_attr_numa_node = __ATTR_RW(numa_node);
+
+static ssize_t completion_cpu_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	int cpu;
+	int retval;
+
+	retval = kstrtoint(buf, 0, &cpu);
+	if (retval)
+		return retval;
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))
+		return -EINVAL;
+
+	retval = usb_rt_set_completion(usb_rt, cpu, READ_ONCE(usb_rt->completion_priority));
+	return retval ? retval : count;
+}
+
+static ssize_t completion_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->completion_cpu);
+}
+struct device_attribute dev_attr_completion_cpu = __ATTR_RW(completion_cpu);
+
+static ssize_t completion_priority_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int priority;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &priority);
+	if (retval)
+		return retval;
+	if (priority > MAX_RT_PRIO - 1)
+		return -EINVAL;
+
+	retval = usb_rt_set_completion(usb_rt, READ_ONCE(usb_rt->completion_cpu), priority);
+	return retval ? retval : count;
+}
+
+static ssize_t completion_priority_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->completion_priority);
+}
+struct device_attribute dev_attr_completion_priority = __ATTR_RW(completion_priority);
+
+static ssize_t read_samples_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->read_samples_dropped);
+}
+struct device_attribute dev_attr_read_samples_dropped = __ATTR_RO(read_samples_dropped);
+
+static ssize_t stream_urbs_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int urbs;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &urbs);
+	if (retval)
+		return retval;
+	if (urbs > STREAM_URBS_MAX)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&usb_rt->io_mutex))
+		return -ERESTARTSYS;
+	if (usb_rt->disconnected) {
+		retval = -ENODEV;
+	} else if (usb_rt->ring || usb_rt->group) {
+		retval = -EBUSY;
+	} else {
+		usb_rt_stream_stop(usb_rt);
+		if (urbs)
+			retval = usb_rt_stream_start(usb_rt, urbs);
+	}
+	mutex_unlock(&usb_rt->io_mutex);
+	return retval ? retval : count;
+}
+
+static ssize_t stream_urbs_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->stream_urbs);
+}
+struct device_attribute dev_attr_stream_urbs = __ATTR_RW(stream_urbs);
+
+/* rounded up to whole packets when the mode is entered */
+static ssize_t stream_urb_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int bytes;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &bytes);
+	if (retval)
+		return retval;
+	if (bytes < 1 || bytes > STREAM_URB_SIZE_MAX)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&usb_rt->io_mutex))
+		return -ERESTARTSYS;
+	/* the stream buffers are freed with this size */
+	if (usb_rt->stream_urbs)
+		retval = -EBUSY;
+	else
+		usb_rt->stream_urb_size = bytes;
+	mutex_unlock(&usb_rt->io_mutex);
+	return retval ? retval : count;
+}
+
+static ssize_t stream_urb_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->stream_urb_size);
+}
+struct device_attribute dev_attr_stream_urb_size = __ATTR_RW(stream_urb_size);
+
+/* used when the mode is entered, rounded up to a power of two */
+static ssize_t stream_ring_kb_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned int kb;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &kb);
+	if (retval)
+		return retval;
+	if (kb < 1 || kb > 4096)
+		return -EINVAL;
+
+	WRITE_ONCE(usb_rt->stream_ring_kb, kb);
+	return count;
+}
+
+static ssize_t stream_ring_kb_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->stream_ring_kb);
+}
+struct device_attribute dev_attr_stream_ring_kb = __ATTR_RW(stream_ring_kb);
+
+/* bytes received, bytes per second and stalls since the mode was entered */
+static ssize_t stream_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	u64 bytes, us;
+	unsigned int stalls;
+
+	spin_lock_irqsave(&usb_rt->err_lock, flags);
+	bytes = usb_rt->stream_bytes;
+	stalls = usb_rt->stream_stalls;
+	us = ktime_us_delta(ktime_get(), usb_rt->stream_start);
+	spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+
+	return sysfs_emit(buf, "%llu %llu %u\n", bytes,
+			  div64_u64(bytes * USEC_PER_SEC, max_t(u64, us, 1)), stalls);
+}
+struct device_attribute dev_attr_stream_stats = __ATTR_RO(stream_stats);
+
+/* polling interval of an interrupt endpoint, 0 for bulk */
+static unsigned int usb_rt_interval_us(struct usb_rt *dev, __u8 interval)
+{
+	if (!interval)
+		return 0;
+	if (dev->udev->speed >= USB_SPEED_HIGH)
+		return 125 << (min_t(__u8, interval, 16) - 1);
+	return interval * 1000;
+}
+
+static ssize_t in_interval_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt_interval_us(usb_rt, usb_rt->bulk_in_interval));
+}
+struct device_attribute dev_attr_in_interval_us = __ATTR_RO(in_interval_us);
+
+static ssize_t out_interval_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt_interval_us(usb_rt, usb_rt->bulk_out_interval));
+}
+struct device_attribute dev_attr_out_interval_us = __ATTR_RO(out_interval_us);
+
+/*
+ * Topology of the device for irq and thread affinity planning. All channels
+ * of a device show the same values.
+ */
+static ssize_t hc_device_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%s\n", dev_name(usb_rt->udev->bus->controller));
+}
+struct device_attribute dev_attr_hc_device = __ATTR_RO(hc_device);
+
+/* irq vectors of a pci host controller with their effective affinity */
+static ssize_t hc_irqs_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	struct device *hc = usb_rt->udev->bus->controller;
+	const struct cpumask *mask;
+	int len = 0;
+	int irq, i;
+
+	if (dev_is_pci(hc)) {
+		for (i = 0; i < HC_IRQS_MAX; i++) {
+			irq = pci_irq_vector(to_pci_dev(hc), i);
+			if (irq < 0)
+				break;
+			mask = irq_get_effective_affinity_mask(irq);
+			if (mask)
+				len += sysfs_emit_at(buf, len, "%s%d:%*pbl", i ? " " : "",
+						     irq, cpumask_pr_args(mask));
+			else
+				len += sysfs_emit_at(buf, len, "%s%d", i ? " " : "", irq);
+		}
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+struct device_attribute dev_attr_hc_irqs = __ATTR_RO(hc_irqs);
+
+/* bus and port path, e.g. 1-2.3 */
+static ssize_t usb_path_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%s\n", dev_name(&usb_rt->udev->dev));
+}
+struct device_attribute dev_attr_usb_path = __ATTR_RO(usb_path);
+
+static ssize_t speed_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%s\n", usb_speed_string(usb_rt->udev->speed));
+}
+struct device_attribute dev_attr_speed = __ATTR_RO(speed);
+
+/* the high speed hub whose transaction translator a full or low speed device uses */
+static ssize_t tt_hub_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	struct usb_tt *tt = usb_rt->udev->tt;
+
+	if (!tt || !tt->hub)
+		return sysfs_emit(buf, "none\n");
+	if (tt->multi)
+		return sysfs_emit(buf, "%s port %d\n", dev_name(&tt->hub->dev),
+				  usb_rt->udev->ttport);
+	return sysfs_emit(buf, "%s\n", dev_name(&tt->hub->dev));
+}
+struct device_attribute dev_attr_tt_hub = __ATTR_RO(tt_hub);
+
+static ssize_t reads_abandoned_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->reads_abandoned);
+}
+struct device_attribute dev_attr_reads_abandoned = __ATTR_RO(reads_abandoned);
+
+static ssize_t control_queue_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	unsigned long flags;
+	bool split;
+	int retval;
+
+	retval = kstrtobool(buf, &split);
+	if (retval)
+		return retval;
+
+	if (mutex_lock_interruptible(&usb_rt->io_mutex))
+		return -ERESTARTSYS;
+	/* the queue stays allocated until the device goes away */
+	if (split && !kfifo_initialized(&usb_rt->control))
+		retval = kfifo_alloc(&usb_rt->control, CONTROL_QUEUE_SIZE, GFP_KERNEL);
+	if (!retval) {
+		spin_lock_irqsave(&usb_rt->err_lock, flags);
+		usb_rt->control_split = split;
+		usb_rt->control_long_left = 0;
+		if (!split)
+			kfifo_reset(&usb_rt->control);
+		spin_unlock_irqrestore(&usb_rt->err_lock, flags);
+	}
+	mutex_unlock(&usb_rt->io_mutex);
+	return retval ? retval : count;
+}
+
+static ssize_t control_queue_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%d\n", usb_rt->control_split);
+}
+struct device_attribute dev_attr_control_queue = __ATTR_RW(control_queue);
+
+static ssize_t control_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_rt *usb_rt = usb_rt_from_dev(dev);
+	return sysfs_emit(buf, "%u\n", usb_rt->control_dropped);
+}
+struct device_attribute dev_attr_control_dropped = __ATTR_RO(control_dropped);
+
+static struct attribute *usb_rt_attrs[] = {
+	&dev_attr_cpu_latency_us.attr,
+	&dev_attr_read_latency.attr,
+	&dev_attr_read_latency_idle.attr,
+	&dev_attr_lpm_disabled.attr,
+	&dev_attr_stall_recoveries.attr,
+	&dev_attr_writes_replaced.attr,
+	&dev_attr_write_depth.attr,
+	&dev_attr_coalesce_us.attr,
+	&dev_attr_coalesce_bytes.attr,
+	&dev_attr_writes_coalesced.attr,
+	&dev_attr_coalesced_transfers.attr,
+	&dev_attr_pace_rate.attr,
+	&dev_attr_pace_burst.attr,
+	&dev_attr_pace_waits.attr,
+	&dev_attr_timeout_adaptive.attr,
+	&dev_attr_timeout_quantile.attr,
+	&dev_attr_timeout_multiple.attr,
+	&dev_attr_timeout_min_ms.attr,
+	&dev_attr_timeout_max_ms.attr,
+	&dev_attr_timeout_effective_us.attr,
+	&dev_attr_timeout_adjustments.attr,
+	&dev_attr_reads_abandoned.attr,
+	&dev_attr_control_queue.attr,
+	&dev_attr_control_dropped.attr,
+	&dev_attr_max_transfer.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_completion_cpu.attr,
+	&dev_attr_completion_priority.attr,
+	&dev_attr_read_samples_dropped.attr,
+	&dev_attr_stream_urbs.attr,
+	&dev_attr_stream_urb_size.attr,
+	&dev_attr_stream_ring_kb.attr,
+	&dev_attr_stream_stats.attr,
+	&dev_attr_in_interval_us.attr,
+	&dev_attr_out_interval_us.attr,
+	&dev_attr_hc_device.attr,
+	&dev_attr_hc_irqs.attr,
+	&dev_attr_usb_path.attr,
+	&dev_attr_speed.attr,
+	&dev_attr_tt_hub.attr,
+	NULL,
+};
+
+static const struct attribute_group usb_rt_attr_group = {
+	.attrs = usb_rt_attrs,
+};
+
+static struct attribute *usb_rt_channel_attrs[] = {
+	&dev_attr_timeout_ms.attr,
+	NULL,
+};
+
+static const struct attribute_group usb_rt_channel_attr_group = {
+	.attrs = usb_rt_channel_attrs,
+};
+
+/* attributes of a channel on its char device node */
+static const struct attribute_group *usb_rt_channel_groups[] = {
+	&usb_rt_attr_group,
+	&usb_rt_channel_attr_group,
+	NULL,
+};
+
+/* take a free minor and publish dev under it */
+static int usb_rt_get_minor(struct usb_rt *dev)
+{
+	int minor;
+
+	mutex_lock(&usb_rt_minors_lock);
+	for (minor = 0; minor < USB_RT_MINORS; minor++) {
+		if (!usb_rt_minors[minor]) {
+			usb_rt_minors[minor] = dev;
+			break;
+		}
+	}
+	mutex_unlock(&usb_rt_minors_lock);
+
+	return minor < USB_RT_MINORS ? minor : -EXFULL;
+}
+
+static void usb_rt_put_minor(struct usb_rt *dev)
+{
+	mutex_lock(&usb_rt_minors_lock);
+	usb_rt_minors[dev->minor] = NULL;
+	mutex_unlock(&usb_rt_minors_lock);
+}
+
+/*
+ * the first channel of interface 0 of the same device, if this driver is
+ * bound to it. Probe and disconnect of all interfaces run under the usb
+ * device lock, so it can't go away while another interface probes.
+ */
+static struct usb_rt *usb_rt_interface0(struct usb_interface *interface)
+{
+	struct usb_interface *intf0;
+
+	intf0 = usb_ifnum_to_if(interface_to_usbdev(interface), 0);
+	if (!intf0 || intf0 == interface || !intf0->dev.driver ||
+	    to_usb_driver(intf0->dev.driver) != &usb_rt_driver)
+		return NULL;
+	return usb_get_intfdata(intf0);
+}
+
+/*
+ * create the char device node, named after the profile, e.g. mtr%d for
+ * motors and usbrt%d for anything else. The first channel of another
+ * interface is named after the node of interface 0 with its interface
+ * number appended, e.g. mtr0.i1, so it doesn't look like another device.
+ * Further channels of an interface are named after its first one with
+ * their channel number appended.
+ */
+static int usb_rt_register_dev(struct usb_rt *dev, struct usb_rt *first,
+			       const struct usb_rt_profile *profile)
+{
+	const char *name = profile->name;
+	struct usb_rt *intf0;
+	unsigned int ifnum;
+	dev_t devt;
+	int minor;
+
+	minor = usb_rt_get_minor(dev);
+	if (minor < 0)
+		return minor;
+	dev->minor = minor;
+
+	devt = MKDEV(MAJOR(usb_rt_devt), minor);
+	ifnum = dev->interface->cur_altsetting->desc.bInterfaceNumber;
+	if (dev != first) {
+		dev->node = device_create_with_groups(usb_rt_class, &dev->interface->dev,
+						      devt, dev, usb_rt_channel_groups,
+						      "%s.%u", dev_name(first->node),
+						      dev->channel);
+	} else if (!ifnum) {
+		dev->node = device_create(usb_rt_class, &dev->interface->dev,
+					  devt, dev, "%s%d", name, minor);
+	} else {
+		intf0 = usb_rt_interface0(dev->interface);
+		if (intf0)
+			dev->node = device_create(usb_rt_class, &dev->interface->dev,
+						  devt, dev, "%s.i%u",
+						  dev_name(intf0->node), ifnum);
+		else
+			dev->node = device_create(usb_rt_class, &dev->interface->dev,
+						  devt, dev, "%s%d.i%u", name, minor,
+						  ifnum);
+	}
+	if (IS_ERR(dev->node)) {
+		usb_rt_put_minor(dev);
+		dev->minor = -1;
+		return PTR_ERR(dev->node);
+	}
+	return 0;
+}
+
+static void usb_rt_deregister_dev(struct usb_rt *dev)
+{
+	device_destroy(usb_rt_class, MKDEV(MAJOR(usb_rt_devt), dev->minor));
+	usb_rt_put_minor(dev);
+}
+
+static bool usb_rt_is_pair(struct usb_endpoint_descriptor *in,
+			   struct usb_endpoint_descriptor *out)
+{
+	return (usb_endpoint_is_bulk_in(in) || usb_endpoint_is_int_in(in)) &&
+	       (usb_endpoint_is_bulk_out(out) || usb_endpoint_is_int_out(out));
+}
+
+/*
+ * Firmware offers interrupt endpoints, which get reserved bandwidth, in an
+ * altsetting of their own. Use the first altsetting with an interrupt pair,
+ * else the current one if it has any pair.
+ */
+static struct usb_host_interface *usb_rt_pick_altsetting(struct usb_interface *interface)
+{
+	struct usb_host_interface *alt, *found = NULL;
+	unsigned int a;
+	int i;
+
+	for (a = 0; a < interface->num_altsetting; a++) {
+		alt = &interface->altsetting[a];
+		for (i = 0; i + 1 < alt->desc.bNumEndpoints; i += 2) {
+			if (!usb_rt_is_pair(&alt->endpoint[i].desc,
+					    &alt->endpoint[i + 1].desc))
+				continue;
+			if (usb_endpoint_xfer_int(&alt->endpoint[i].desc) ||
+			    usb_endpoint_xfer_int(&alt->endpoint[i + 1].desc))
+				return alt;
+			if (!found || alt == interface->cur_altsetting)
+				found = alt;
+		}
+	}
+	return found ? found : interface->cur_altsetting;
+}
+
+/* allocate the state and read urb of one channel */
+static struct usb_rt *usb_rt_create(struct usb_interface *interface,
+				    struct usb_endpoint_descriptor *bulk_in,
+				    struct usb_endpoint_descriptor *bulk_out,
+				    const struct usb_rt_profile *profile)
+{
+	struct usb_device *udev = interface_to_usbdev(interface);
+	int node = dev_to_node(udev->bus->controller);
+	struct usb_rt *dev;
+
+	/*
+	 * allocate memory for our device state and initialize it, on the node
+	 * of the host controller that completes our urbs. Coherent buffers
+	 * follow the controller already.
+	 */
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&dev->kref);
+	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+	sema_init(&dev->prio_sem, PRIORITY_WRITES_IN_FLIGHT);
+	mutex_init(&dev->io_mutex);
+	mutex_init(&dev->reset_mutex);
+	mutex_init(&dev->realtime_mutex);
+	mutex_init(&dev->latest_mutex);
+	mutex_init(&dev->coalesce_mutex);
+	mutex_init(&dev->completion_mutex);
+	spin_lock_init(&dev->err_lock);
+	spin_lock_init(&dev->tap_lock);
+	init_usb_anchor(&dev->submitted);
+	init_usb_anchor(&dev->deferred);
+	init_usb_anchor(&dev->write_failed);
+	init_usb_anchor(&dev->stream_submitted);
+	init_usb_anchor(&dev->stream_idle);
+	init_usb_anchor(&dev->stream_done);
+	init_waitqueue_head(&dev->bulk_in_wait);
+	INIT_LIST_HEAD(&dev->taps);
+	INIT_KFIFO(dev->events);
+	INIT_KFIFO(dev->read_samples);
+	kthread_init_work(&dev->completion_work, usb_rt_completion_work);
+	INIT_WORK(&dev->stall_work, usb_rt_stall_work);
+	INIT_WORK(&dev->write_free_work, usb_rt_write_free_work);
+	init_waitqueue_head(&dev->coalesce_wait);
+	usb_rt_hrtimer_init(&dev->coalesce_timer, usb_rt_coalesce_timer);
+	usb_rt_hrtimer_init(&dev->pace_timer, usb_rt_pace_timer);
+
+	dev->udev = usb_get_dev(interface_to_usbdev(interface));
+	dev->interface = usb_get_intf(interface);
+	dev->minor = -1;
+	dev->completion_cpu = -1;
+	dev->numa_node = node;
+	dev->timeout_ms = profile->timeout_ms;
+	dev->timeout_adaptive = profile->timeout_adaptive;
+	dev->max_transfer = clamp_t(size_t, profile->max_transfer, 1, MAX_TRANSFER);
+	dev->out_depth = clamp_t(unsigned int, profile->write_depth, 1, WRITES_IN_FLIGHT);
+	dev->pace_burst = 1;
+	dev->stream_urb_size = 16 * 1024;
+	dev->stream_ring_kb = 1024;
+	dev->coalesce_us = profile->coalesce_us;
+	dev->coalesce_bytes = profile->coalesce_bytes;
+	dev->cpu_latency_us = profile->cpu_latency_us;
+	dev->timeout_quantile = 999;
+	dev->timeout_multiple = 300;
+	dev->timeout_min_ms = 2;
+	dev->timeout_max_ms = 100;
+
+	/* high bandwidth interrupt endpoints move several packets per interval */
+	dev->bulk_in_size = usb_endpoint_maxp(bulk_in) * usb_endpoint_maxp_mult(bulk_in);
+	dev->bulk_in_endpointAddr = bulk_in->bEndpointAddress;
+	if (usb_endpoint_xfer_int(bulk_in))
+		dev->bulk_in_interval = bulk_in->bInterval;
+	if (usb_endpoint_xfer_int(bulk_out))
+		dev->bulk_out_interval = bulk_out->bInterval;
+	dev->bulk_in_urb = usb_rt_alloc_urb(dev, GFP_KERNEL);
+	if (!dev->bulk_in_urb)
+		goto error;
+	dev->bulk_in_buffer = usb_alloc_coherent(dev->udev, dev->bulk_in_size, GFP_KERNEL,
+				 &dev->bulk_in_urb->transfer_dma);
+	if (!dev->bulk_in_buffer)
+		goto error;
+	dev->bulk_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
+	return dev;
+
+error:
+	/* this frees allocated memory */
+	kref_put(&dev->kref, usb_rt_delete);
+	return ERR_PTR(-ENOMEM);
+}
+
+/* unregister a channel and stop its io, drops the probe reference */
+static void usb_rt_remove_channel(struct usb_rt *dev)
+{
+	/* give back our minor, open can't find dev any more */
+	if (dev->minor >= 0)
+		usb_rt_deregister_dev(dev);
+
+	/*
+	 * prevent more I/O from starting, completions and stall_work check
+	 * disconnected under err_lock
+	 */
+	mutex_lock(&dev->io_mutex);
+	spin_lock_irq(&dev->err_lock);
+	dev->disconnected = 1;
+	spin_unlock_irq(&dev->err_lock);
+	usb_rt_stream_stop(dev);
+	mutex_unlock(&dev->io_mutex);
+
+	/* a running stall recovery could resubmit the urbs killed below */
+	cancel_work_sync(&dev->stall_work);
+	usb_kill_urb(dev->bulk_in_urb);
+	usb_rt_tap_hangup(dev);
+	hrtimer_cancel(&dev->pace_timer);
+	cancel_work_sync(&dev->write_free_work);
+	usb_rt_drop_deferred(dev);
+	usb_rt_coalesce_drop(dev);
+	usb_kill_anchored_urbs(&dev->submitted);
+	usb_rt_set_completion(dev, -1, 0);
+
+	/* decrement our usage count */
+	kref_put(&dev->kref, usb_rt_delete);
+}
+
+static void usb_rt_remove_channels(struct usb_rt *dev)
+{
+	struct usb_rt *next;
+
+	for (; dev; dev = next) {
+		next = dev->next;
+		usb_rt_remove_channel(dev);
+	}
+}
+
+static int usb_rt_probe(struct usb_interface *interface,
+		      const struct usb_device_id *id)
+{
+	const struct usb_rt_profile *profile = (const struct usb_rt_profile *)id->driver_info;
+	struct usb_host_interface *alt = usb_rt_pick_altsetting(interface);
+	struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+	struct usb_rt *dev = NULL, *chan, **tail = &dev;
+	bool text_api = false;
+	unsigned int channel = 0;
+	int retval;
+	int i;
+
+	if (!profile)
+		profile = &usb_rt_default_profile;
+
+	if (alt != interface->cur_altsetting) {
+		retval = usb_set_interface(interface_to_usbdev(interface),
+					   alt->desc.bInterfaceNumber,
+					   alt->desc.bAlternateSetting);
+		if (retval) {
+			dev_warn(&interface->dev,
+				 "%s - could not select altsetting %d, error %d\n",
+				 __func__, alt->desc.bAlternateSetting, retval);
+			alt = interface->cur_altsetting;
+		}
+	}
+
+	/*
+	 * every bulk-in endpoint followed by a bulk-out endpoint is a channel,
+	 * either may be an interrupt endpoint instead.
+	 * On interface number 0 the first pair is the realtime channel and
+	 * the second pair is the text api, this is the current convention.
+	 */
+	for (i = 0; i + 1 < alt->desc.bNumEndpoints; i += 2) {
+		bulk_in = &alt->endpoint[i].desc;
+		bulk_out = &alt->endpoint[i + 1].desc;
+		if (!usb_rt_is_pair(bulk_in, bulk_out))
+			continue;
+		if (alt->desc.bInterfaceNumber == 0 && i == 2 && dev) {
+			// text api interface
+			text_api = true;
+			continue;
+		}
+
+		chan = usb_rt_create(interface, bulk_in, bulk_out, profile);
+		if (IS_ERR(chan)) {
+			retval = PTR_ERR(chan);
+			goto error;
+		}
+		chan->channel = channel++;
+		*tail = chan;
+		tail = &chan->next;
+	}
+	if (!dev) {
+		dev_err(&interface->dev,
+			"Could not find both bulk-in and bulk-out endpoints\n");
+		return -ENODEV;
+	}
+
+	if (text_api) {
+		dev->text_api_buffer = kmalloc_node(MAX_TRANSFER, GFP_KERNEL,
+						    dev->numa_node);
+		if (!dev->text_api_buffer) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		dev->has_text_api = true;
+		retval = device_create_file(&interface->dev, &dev_attr_text_api);
+		if (retval)
+			goto error;
+		retval = device_create_file(&interface->dev, &dev_attr_timeout_ms);
+		if (retval)
+			goto error;
+	}
+
+	retval = sysfs_create_group(&interface->dev.kobj, &usb_rt_attr_group);
+	if (retval)
+		goto error;
+
+	/* save our data pointer in this interface device */
+	usb_set_intfdata(interface, dev);
+
+	/* we can register the devices now, as they are ready */
+	for (chan = dev; chan; chan = chan->next) {
+		retval = usb_rt_register_dev(chan, dev, profile);
+		if (retval) {
+			/* something prevented us from registering this driver */
+			dev_err(&interface->dev,
+				"Not able to get a minor for this device.\n");
+			usb_set_intfdata(interface, NULL);
+			sysfs_remove_group(&interface->dev.kobj, &usb_rt_attr_group);
+			goto error;
+		}
+
+		/* let the user know what node this device is now attached to */
+		dev_info(&interface->dev,
+			 "USB RT device now attached to %s",
+			 dev_name(chan->node));
+	}
+	return 0;
+
+error:
+	if (dev && dev->has_text_api) {
+		device_remove_file(&interface->dev, &dev_attr_text_api);
+		device_remove_file(&interface->dev, &dev_attr_timeout_ms);
+	}
+	usb_rt_remove_channels(dev);
+
+	return retval;
+}
+
+static void usb_rt_disconnect(struct usb_interface *interface)
+{
+	struct usb_rt *dev;
+	int minor;
+
+	dev = usb_get_intfdata(interface);
+	minor = dev->minor;
+	if (dev->has_text_api == true)
+		device_remove_file(&interface->dev, &dev_attr_text_api);
+	device_remove_file(&interface->dev, &dev_attr_timeout_ms);
+	sysfs_remove_group(&interface->dev.kobj, &usb_rt_attr_group);
+	usb_set_intfdata(interface, NULL);
+
+	usb_rt_remove_channels(dev);
+
+	dev_info(&interface->dev, "USB RT #%d disconnected", minor);
+}
+
+/* writes killed on purpose are not reported as errors */
+static void usb_rt_clear_kill_errors(struct usb_rt *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->errors == -ENOENT || dev->errors == -ECONNRESET)
+		dev->errors = 0;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+}
+
+/* drop all writes in flight, returns how many did not complete */
+static int usb_rt_cancel_writes(struct usb_rt *dev)
+{
+	struct urb *urb;
+	int dropped;
+
+	/* deferred writes first, so completions don't submit them */
+	dropped = usb_rt_drop_deferred(dev);
+	dropped += usb_rt_coalesce_drop(dev);
+
+	/*
+	 * only count the urbs this call killed, not those killed meanwhile by
+	 * another fd's cancel or by suspend, nor writes that completed first
+	 */
+	while ((urb = usb_get_from_anchor(&dev->submitted))) {
+		usb_kill_urb(urb);
+		if (urb->status == -ENOENT)
+			dropped++;
+		usb_free_urb(urb);
+	}
+
+	usb_rt_clear_kill_errors(dev);
+	return dropped;
+}
+
+static void usb_rt_draw_down(struct usb_rt *dev)
+{
+	unsigned long flags;
+	int time;
+
+	/* send collected records now instead of after the window */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->coalesce_urb)
+		usb_rt_coalesce_flush(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	time = usb_wait_anchor_empty_timeout(&dev->deferred, 1000);
+	if (time)
+		time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
+	if (!time) {
+		usb_rt_drop_deferred(dev);
+		usb_rt_coalesce_drop(dev);
+		usb_kill_anchored_urbs(&dev->submitted);
+	}
+	usb_rt_kill_read(dev);
+}
+
+/* stop io for suspend or reset, an interrupted read is rearmed afterwards */
+static void usb_rt_quiesce(struct usb_rt *dev)
+{
+	unsigned long flags;
+
+	/* a pending stall recovery is restarted by usb_rt_rearm() */
+	cancel_work_sync(&dev->stall_work);
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->rearm_read = dev->ongoing_read;
+	dev->stream_held = true;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* stream urbs wait on stream_idle until usb_rt_rearm() */
+	usb_kill_anchored_urbs(&dev->stream_submitted);
+	usb_rt_draw_down(dev);
+	/* deferred writes are drained or dropped now, nothing left to release */
+	hrtimer_cancel(&dev->pace_timer);
+	usb_rt_free_failed_writes(dev);
+	usb_rt_clear_kill_errors(dev);
+}
+
+/* restart io after resume or reset and let userspace know */
+static void usb_rt_rearm(struct usb_rt *dev, __u32 event)
+{
+	unsigned long flags;
+	bool rearm, halted;
+	int rv = 0;
+
+	/* the read may have completed before it could be killed */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	rearm = dev->rearm_read && dev->ongoing_read && !dev->in_halted;
+	halted = dev->in_halted || dev->out_halted;
+	dev->rearm_read = false;
+	/* a reset device doesn't finish the long packet it was sending */
+	if (event == USB_RT_EVENT_RESET)
+		dev->control_long_left = 0;
+	dev->bulk_in_submitted = ktime_get();
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* stall_work resubmits a read that stalled */
+	if (halted)
+		schedule_work(&dev->stall_work);
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->stream_held = false;
+	usb_rt_stream_fill(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	if (rearm) {
+		rv = usb_submit_urb(dev->bulk_in_urb, GFP_NOIO);
+		if (rv < 0) {
+			dev_err(&dev->interface->dev,
+				"%s - failed resubmitting read urb, error %d\n",
+				__func__, rv);
+			spin_lock_irqsave(&dev->err_lock, flags);
+			dev->errors = rv;
+			dev->ongoing_read = 0;
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+		}
+	}
+
+	usb_rt_queue_event(dev, event, rv, 0);
+}
+
+static int usb_rt_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct usb_rt *dev = usb_get_intfdata(intf);
+
+	for (; dev; dev = dev->next)
+		usb_rt_quiesce(dev);
+	return 0;
+}
+
+static int usb_rt_resume(struct usb_interface *intf)
+{
+	struct usb_rt *dev = usb_get_intfdata(intf);
+
+	for (; dev; dev = dev->next)
+		usb_rt_rearm(dev, USB_RT_EVENT_RESUME);
+	return 0;
+}
+
+static int usb_rt_reset_resume(struct usb_interface *intf)
+{
+	struct usb_rt *dev = usb_get_intfdata(intf);
+
+	for (; dev; dev = dev->next)
+		usb_rt_rearm(dev, USB_RT_EVENT_RESET);
+	return 0;
+}
+
+static int usb_rt_pre_reset(struct usb_interface *intf)
+{
+	struct usb_rt *first = usb_get_intfdata(intf);
+	struct usb_rt *dev;
+
+	/* the io_mutexes of all channels share a lock class */
+	mutex_lock(&first->reset_mutex);
+	for (dev = first; dev; dev = dev->next) {
+		mutex_lock_nest_lock(&dev->io_mutex, &first->reset_mutex);
+		usb_rt_quiesce(dev);
+	}
+
+	return 0;
+}
+
+static int usb_rt_post_reset(struct usb_interface *intf)
+{
+	struct usb_rt *first = usb_get_intfdata(intf);
+	struct usb_rt *dev;
+
+	/* we are sure no URBs are active */
+	for (dev = first; dev; dev = dev->next) {
+		usb_rt_rearm(dev, USB_RT_EVENT_RESET);
+		mutex_unlock(&dev->io_mutex);
+	}
+	mutex_unlock(&first->reset_mutex);
+
+	return 0;
+}
+
+/*
+ * The control node. Every open gets a shared receive ring that userspace
+ * maps and that devices are enrolled in by minor.
+ */
+static int usb_rt_ctl_open(struct inode *inode, struct file *file)
+{
+	struct usb_rt_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->mem = vmalloc_user(USB_RT_RING_SIZE);
+	if (!ring->mem) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->header = ring->mem;
+	ring->records = ring->mem + USB_RT_RING_RECORD_OFFSET;
+	ring->header->records = USB_RT_RING_RECORDS;
+	ring->header->record_size = sizeof(struct usb_rt_record);
+	ring->header->record_offset = USB_RT_RING_RECORD_OFFSET;
+	atomic64_set(&ring->head, 0);
+	init_waitqueue_head(&ring->wait);
+	mutex_init(&ring->lock);
+
+	file->private_data = ring;
+	return 0;
+}
+
+/*
+ * The device of an open device node, with a reference. Taking devices by fd
+ * rather than minor means only who may open a device can enroll it.
+ */
+static struct usb_rt *usb_rt_get_fd(int fd)
+{
+	struct fd f = fdget(fd);
+	struct usb_rt *dev;
+
+	if (!fd_file(f))
+		return ERR_PTR(-EBADF);
+	if (fd_file(f)->f_op != &usb_rt_fops) {
+		fdput(f);
+		return ERR_PTR(-EINVAL);
+	}
+	dev = ((struct usb_rt_file *)fd_file(f)->private_data)->dev;
+	kref_get(&dev->kref);
+	fdput(f);
+	return dev;
+}
+
+/*
+ * Keeps the read of the device of fd on the bus and routes its packets to a
+ * ring or a group member instead of read(). Returns the device with a
+ * reference.
+ */
+static struct usb_rt *usb_rt_attach(int fd, struct usb_rt_ring *ring,
+				    struct usb_rt_group *group, unsigned int member)
+{
+	struct usb_rt *dev;
+	unsigned long flags;
+	int rv;
+
+	dev = usb_rt_get_fd(fd);
+	if (IS_ERR(dev))
+		return dev;
+
+	rv = usb_autopm_get_interface(dev->interface);
+	if (rv)
+		goto error;
+
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {
+		rv = -ENODEV;
+		goto error_io;
+	}
+	if (dev->ring || dev->group || dev->stream_urbs) {
+		rv = -EBUSY;
+		goto error_io;
+	}
+
+	/* a pending low latency read now completes into the ring or group */
+	usb_rt_kill_read(dev);
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_discard_read(dev);
+	dev->ring = ring;
+	dev->ring_seq = 0;
+	dev->group = group;
+	dev->group_member = member;
+	dev->enrolled_errors = 0;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	rv = usb_rt_do_read_io(dev, dev->bulk_in_size);
+	if (rv) {
+		spin_lock_irqsave(&dev->err_lock, flags);
+		dev->ring = NULL;
+		dev->group = NULL;
+		spin_unlock_irqrestore(&dev->err_lock, flags);
+		goto error_io;
+	}
+	mutex_unlock(&dev->io_mutex);
+	return dev;
+
+error_io:
+	mutex_unlock(&dev->io_mutex);
+	usb_autopm_put_interface(dev->interface);
+error:
+	kref_put(&dev->kref, usb_rt_delete);
+	return ERR_PTR(rv);
+}
+
+/* gives the device back to read() and drops the reference of usb_rt_attach() */
+static void usb_rt_detach(struct usb_rt *dev)
+{
+	unsigned long flags;
+
+	mutex_lock(&dev->io_mutex);
+	spin_lock_irqsave(&dev->err_lock, flags);
+	dev->ring = NULL;
+	dev->group = NULL;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	usb_rt_kill_read(dev);
+	spin_lock_irqsave(&dev->err_lock, flags);
+	usb_rt_discard_read(dev);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	mutex_unlock(&dev->io_mutex);
+
+	usb_autopm_put_interface(dev->interface);
+	kref_put(&dev->kref, usb_rt_delete);
+}
+
+/* called with ring->lock held */
+static int usb_rt_ring_enroll(struct usb_rt_ring *ring, int fd)
+{
+	struct usb_rt *dev;
+	int slot;
+
+	for (slot = 0; slot < RING_DEVS; slot++)
+		if (!ring->devs[slot])
+			break;
+	if (slot == RING_DEVS)
+		return -ENOSPC;
+
+	dev = usb_rt_attach(fd, ring, NULL, 0);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+
+	ring->devs[slot] = dev;
+	return 0;
+}
+
+/* called with ring->lock held */
+static void usb_rt_ring_leave(struct usb_rt_ring *ring, int slot)
+{
+	usb_rt_detach(ring->devs[slot]);
+	ring->devs[slot] = NULL;
+}
+
+static int usb_rt_ctl_release(struct inode *inode, struct file *file)
+{
+	struct usb_rt_ring *ring = file->private_data;
+	int slot;
+
+	mutex_lock(&ring->lock);
+	for (slot = 0; slot < RING_DEVS; slot++)
+		if (ring->devs[slot])
+			usb_rt_ring_leave(ring, slot);
+	mutex_unlock(&ring->lock);
+
+	vfree(ring->mem);
+	kfree(ring);
+	return 0;
+}
+
+static int usb_rt_ctl_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usb_rt_ring *ring = file->private_data;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static __poll_t usb_rt_ctl_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct usb_rt_ring *ring = file->private_data;
+
+	poll_wait(file, &ring->wait, wait);
+	if (READ_ONCE(ring->header->tail) < atomic64_read(&ring->head))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static void usb_rt_group_urb_free(struct usb_rt_group_member *m, struct urb *urb,
+				  u8 *buf)
+{
+	if (!urb)
+		return;
+	usb_kill_urb(urb);
+	usb_free_coherent(m->dev->udev, m->urb_size, buf, urb->transfer_dma);
+	usb_free_urb(urb);
+}
+
+static void usb_rt_group_free(struct usb_rt_group *group)
+{
+	struct usb_rt_group_member *m;
+	unsigned int i;
+
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		usb_rt_group_urb_free(m, m->cmd_urb, m->cmd_buf);
+		usb_rt_group_urb_free(m, m->bcast_urb, m->bcast_buf);
+		usb_rt_detach(m->dev);
+		kfree(m->data);
+	}
+	kfree(group);
+}
+
+static struct urb *usb_rt_group_urb_alloc(struct usb_rt_group_member *m, u8 **buf)
+{
+	struct urb *urb;
+
+	urb = usb_rt_alloc_urb(m->dev, GFP_KERNEL);
+	if (!urb)
+		return NULL;
+	*buf = usb_alloc_coherent(m->dev->udev, m->urb_size, GFP_KERNEL,
+				  &urb->transfer_dma);
+	if (!*buf) {
+		usb_free_urb(urb);
+		return NULL;
+	}
+	return urb;
+}
+
+/* stages the urbs of a member for commands and broadcasts of up to max_transfer bytes */
+static int usb_rt_group_urbs_alloc(struct usb_rt_group_member *m)
+{
+	m->urb_size = READ_ONCE(m->dev->max_transfer);
+	m->cmd_urb = usb_rt_group_urb_alloc(m, &m->cmd_buf);
+	if (!m->cmd_urb)
+		return -ENOMEM;
+	m->bcast_urb = usb_rt_group_urb_alloc(m, &m->bcast_buf);
+	if (!m->bcast_urb)
+		return -ENOMEM;
+	return 0;
+}
+
+static void usb_rt_group_bcast_callback(struct urb *urb)
+{
+	struct usb_rt_group_member *m = urb->context;
+	struct usb_rt_group *group = m->group;
+	struct usb_rt *dev = m->dev;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	/* sync/async unlink faults aren't errors */
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed++;
+	}
+
+	spin_lock(&group->lock);
+	m->bcast_status = urb->status;
+	m->bcast_complete_ns = now;
+	if (!--group->bcast_pending)
+		wake_up_interruptible(&group->wait);
+	spin_unlock(&group->lock);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+}
+
+/*
+ * Sends the same packet to every member. The packet is staged in the
+ * preallocated urbs first, then all of them are submitted in one loop with
+ * local interrupts off, so neither an interrupt nor preemption stretches
+ * the skew between the first and the last device. Broadcasts bypass the
+ * write queue and pacing of the devices.
+ */
+static long usb_rt_group_broadcast(struct usb_rt_group *group,
+				   struct usb_rt_group_broadcast __user *arg)
+{
+	struct usb_rt_group_broadcast req;
+	struct usb_rt_broadcast_time time = { 0 };
+	struct usb_rt_broadcast_time __user *times;
+	struct usb_rt_group_member *m;
+	struct usb_rt *dev;
+	unsigned long flags;
+	unsigned int i;
+	long timeout;
+	u8 *buf;
+	int rv;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (!req.len)
+		return -EINVAL;
+	for (i = 0; i < group->nmembers; i++)
+		if (req.len > group->members[i].urb_size)
+			return -EINVAL;
+
+	buf = memdup_user(u64_to_user_ptr(req.buf), req.len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	if (mutex_lock_interruptible(&group->mutex)) {
+		kfree(buf);
+		return -ERESTARTSYS;
+	}
+
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		memcpy(m->bcast_buf, buf, req.len);
+		usb_rt_fill_out_urb(m->dev, m->bcast_urb, m->bcast_buf, req.len,
+				    usb_rt_group_bcast_callback);
+		m->bcast_urb->context = m;
+		m->bcast_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		m->bcast_status = -EINPROGRESS;
+		m->bcast_submit_ns = 0;
+		m->bcast_complete_ns = 0;
+	}
+	kfree(buf);
+
+	spin_lock_irqsave(&group->lock, flags);
+	group->bcast_pending = group->nmembers;
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	local_irq_save(flags);
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		dev = m->dev;
+
+		/*
+		 * usb_rt_remove_channel() sets disconnected under err_lock
+		 * before it kills the anchored urbs, so a urb submitted here
+		 * is either seen by that kill or not submitted at all
+		 */
+		spin_lock(&dev->err_lock);
+		if (dev->disconnected) {
+			rv = -ENODEV;
+		} else {
+			/* anchored so cancel, suspend and disconnect kill it */
+			usb_anchor_urb(m->bcast_urb, &dev->submitted);
+			rv = usb_submit_urb(m->bcast_urb, GFP_ATOMIC);
+			if (rv)
+				usb_unanchor_urb(m->bcast_urb);
 		}
-	} // else always fall back to just returning the data
-	return count_received;
+		spin_unlock(&dev->err_lock);
+
+		m->bcast_submit_ns = ktime_get_ns();
+		if (rv) {
+			spin_lock(&group->lock);
+			m->bcast_status = rv;
+			group->bcast_pending--;
+			spin_unlock(&group->lock);
+		}
+	}
+	local_irq_restore(flags);
+
+	/* the urbs are reused, so they can't outlive the ioctl */
+	timeout = wait_event_interruptible_timeout(group->wait,
+						   !READ_ONCE(group->bcast_pending),
+						   msecs_to_jiffies(group->timeout_ms));
+	if (timeout <= 0)
+		for (i = 0; i < group->nmembers; i++)
+			usb_kill_urb(group->members[i].bcast_urb);
+	mutex_unlock(&group->mutex);
+
+	times = u64_to_user_ptr(req.times);
+	for (i = 0; times && i < group->nmembers; i++) {
+		m = &group->members[i];
+		time.status = m->bcast_status;
+		time.submit_ns = m->bcast_submit_ns;
+		time.complete_ns = m->bcast_complete_ns;
+		if (copy_to_user(&times[i], &time, sizeof(time)))
+			return -EFAULT;
+	}
+
+	if (timeout < 0)
+		return timeout;
+	return timeout ? 0 : -ETIMEDOUT;
 }
-struct device_attribute dev_attr_text_api = __ATTR_RW(text_api);
 
-static ssize_t timeout_ms_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)		
+static long usb_rt_group_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
 {
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usb_rt *usb_rt = usb_get_intfdata(intf);
-	sscanf(buf, "%d", &usb_rt->timeout_ms);
-	return count;	
+	struct usb_rt_group *group = file->private_data;
+
+	switch (cmd) {
+	case USB_RT_IOC_GROUP_BROADCAST:
+		return usb_rt_group_broadcast(group, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
 }
 
-static ssize_t timeout_ms_show(struct device *dev, struct device_attribute *attr, char *buf)		
+static int usb_rt_group_release(struct inode *inode, struct file *file)
 {
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usb_rt *usb_rt = usb_get_intfdata(intf);	
-	return sysfs_emit(buf, "%d\n", usb_rt->timeout_ms);	
+	usb_rt_group_free(file->private_data);
+	return 0;
+}
+
+static void usb_rt_group_cmd_callback(struct urb *urb)
+{
+	struct usb_rt_group_member *m = urb->context;
+	struct usb_rt_group *group = m->group;
+	struct usb_rt *dev = m->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (urb->status == -EPIPE) {
+		usb_rt_halted(dev, &dev->out_halted);
+	/* sync/async unlink faults aren't errors */
+	} else if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			dev_err(&dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		dev->errors = urb->status;
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET)
+			dev->writes_killed++;
+	}
+	m->cmd_busy = false;
+
+	/* no reply comes to a command that wasn't sent */
+	spin_lock(&group->lock);
+	if (urb->status && m->pending) {
+		m->pending = false;
+		m->status = urb->status;
+		group->pending--;
+	}
+	spin_unlock(&group->lock);
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	/* wakes cycle readers and writers waiting for cmd_urb */
+	wake_up_interruptible(&group->wait);
 }
-struct device_attribute dev_attr_timeout_ms = __ATTR_RW(timeout_ms);
 
 /*
- * usb class driver info in order to get a minor number from the usb core,
- * and to have the device registered with the driver core
+ * Validates the command vector of a group write, fills cmds with a pointer
+ * to the command of each member or NULL.
  */
-// The generic class
-static struct usb_class_driver usb_rt_class = {
-	.name =		"usbrt%d",
-	.fops =		&usb_rt_fops,
-	.minor_base =	USB_RT_MINOR_BASE,
-};
+static int usb_rt_group_parse(struct usb_rt_group *group, u8 *buf, size_t count,
+			      struct usb_rt_group_cmd **cmds)
+{
+	struct usb_rt_group_cmd *cmd;
+	size_t offset = 0;
 
-// A specialized name for motors
-static struct usb_class_driver usb_mtr_class = {
-	.name =		"mtr%d",
-	.fops =		&usb_rt_fops,
-	.minor_base =	USB_RT_MINOR_BASE,
-};
+	while (offset < count) {
+		if (count - offset < sizeof(*cmd))
+			return -EINVAL;
+		cmd = (struct usb_rt_group_cmd *)(buf + offset);
+		offset += sizeof(*cmd);
+		if (cmd->member >= group->nmembers || cmds[cmd->member] ||
+		    !cmd->len || cmd->len > count - offset ||
+		    cmd->len > group->members[cmd->member].urb_size)
+			return -EINVAL;
+		cmds[cmd->member] = cmd;
+		offset += cmd->len;
+	}
+	return 0;
+}
 
-static int usb_rt_probe(struct usb_interface *interface,
-		      const struct usb_device_id *id)
+/*
+ * Commands go out through the preallocated urbs of the members, staged first
+ * and then submitted in one loop with local interrupts off like broadcasts.
+ * They bypass the write queue and pacing of the devices.
+ */
+static ssize_t usb_rt_group_write(struct file *file, const char __user *user_buffer,
+				  size_t count, loff_t *ppos)
 {
+	struct usb_rt_group *group = file->private_data;
+	struct usb_rt_group_cmd **cmds;
+	struct usb_rt_group_member *m;
 	struct usb_rt *dev;
-	struct usb_endpoint_descriptor *bulk_in=NULL, *bulk_out=NULL;
+	unsigned long flags;
+	unsigned int i;
+	u8 *buf;
 	int retval;
+	int rv;
 
-	/* allocate memory for our device state and initialize it */
-	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
-	if (!dev)
-		return -ENOMEM;
-
-	kref_init(&dev->kref);
-	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
-	mutex_init(&dev->io_mutex);
-	spin_lock_init(&dev->err_lock);
-	init_usb_anchor(&dev->submitted);
-	init_waitqueue_head(&dev->bulk_in_wait);
+	if (count == 0)
+		return 0;
+	if (count > GROUP_WRITE_MAX)
+		return -EINVAL;
 
-	dev->udev = usb_get_dev(interface_to_usbdev(interface));
-	dev->interface = usb_get_intf(interface);
-	dev->timeout_ms = 10;
-
-	/* set up the endpoint information */
-	/* use only the first bulk-in and bulk-out endpoints on interface number 0
-	   is the current convention */
-
-	retval = 0;
-	if (interface->cur_altsetting->desc.bInterfaceNumber == 0 &&
-		usb_endpoint_is_bulk_in(&interface->cur_altsetting->endpoint[0].desc) &&
-		usb_endpoint_is_bulk_out(&interface->cur_altsetting->endpoint[1].desc)) {
-		// realtime interface
-		bulk_in = &interface->cur_altsetting->endpoint[0].desc;
-		bulk_out = &interface->cur_altsetting->endpoint[1].desc;
-		if (interface->cur_altsetting->desc.bNumEndpoints == 4 &&
-			usb_endpoint_is_bulk_in(&interface->cur_altsetting->endpoint[2].desc) &&
-			usb_endpoint_is_bulk_out(&interface->cur_altsetting->endpoint[3].desc)) {
-			// text api interface
-			retval = device_create_file(&interface->dev, &dev_attr_text_api);
-			dev->has_text_api = true;
-			if (retval)
-				goto error;
-			retval = device_create_file(&interface->dev, &dev_attr_timeout_ms);
-			if (retval)
-				goto error;
-		}
-	} else {
-		retval = 1;
-	}
-	if (retval) {
-		dev_err(&interface->dev,
-			"Could not find both bulk-in and bulk-out endpoints\n");
-		goto error;
-	}
+	buf = memdup_user(user_buffer, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
 
-	dev->bulk_in_size = usb_endpoint_maxp(bulk_in);
-	dev->bulk_in_endpointAddr = bulk_in->bEndpointAddress;
-	dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dev->bulk_in_urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	dev->bulk_in_buffer = usb_alloc_coherent(dev->udev, dev->bulk_in_size, GFP_KERNEL,
-				 &dev->bulk_in_urb->transfer_dma);
-	if (!dev->bulk_in_buffer) {
+	cmds = kcalloc(group->nmembers, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds) {
 		retval = -ENOMEM;
-		goto error;
+		goto exit;
 	}
-	dev->bulk_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
 
-	dev->text_api_buffer = kmalloc(MAX_TRANSFER, GFP_KERNEL);
-	if (!dev->text_api_buffer) {
-		retval = -ENOMEM;
-		goto error;
+	retval = usb_rt_group_parse(group, buf, count, cmds);
+	if (retval)
+		goto exit;
+
+	if (mutex_lock_interruptible(&group->mutex)) {
+		retval = -ERESTARTSYS;
+		goto exit;
 	}
 
-	/* save our data pointer in this interface device */
-	usb_set_intfdata(interface, dev);
+	for (i = 0; i < group->nmembers; i++) {
+		if (!cmds[i])
+			continue;
+		m = &group->members[i];
 
-	/* we can register the device now, as it is ready */
-	switch (id->idProduct) {
-		case UNHUMAN_MTR_PRODUCT_ID:
-			retval = usb_register_dev(interface, &usb_mtr_class);
-			break;
-		default:
-			retval = usb_register_dev(interface, &usb_rt_class);
-			break;
+		/* the command of the previous cycle may still be on the bus */
+		if (file->f_flags & O_NONBLOCK) {
+			if (READ_ONCE(m->cmd_busy)) {
+				retval = -EAGAIN;
+				goto unlock;
+			}
+		} else if (wait_event_interruptible(group->wait, !READ_ONCE(m->cmd_busy))) {
+			retval = -ERESTARTSYS;
+			goto unlock;
+		}
+
+		memcpy(m->cmd_buf, cmds[i] + 1, cmds[i]->len);
+		usb_rt_fill_out_urb(m->dev, m->cmd_urb, m->cmd_buf, cmds[i]->len,
+				    usb_rt_group_cmd_callback);
+		m->cmd_urb->context = m;
+		m->cmd_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
-	if (retval) {
-		/* something prevented us from registering this driver */
-		dev_err(&interface->dev,
-			"Not able to get a minor for this device.\n");
-		usb_set_intfdata(interface, NULL);
-		goto error;
+
+	/* start the cycle before any reply can arrive */
+	spin_lock_irqsave(&group->lock, flags);
+	group->cycle++;
+	group->active = true;
+	group->pending = 0;
+	group->start_ns = ktime_get_ns();
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		m->pending = cmds[i] != NULL;
+		m->status = cmds[i] ? 0 : -ENODATA;
+		m->len = 0;
+		m->reply_ns = 0;
+		group->pending += m->pending;
 	}
+	spin_unlock_irqrestore(&group->lock, flags);
 
-	/* let the user know what node this device is now attached to */
-	dev_info(&interface->dev,
-		 "USB RT device now attached to USBRT-%d",
-		 interface->minor);
-	return 0;
+	local_irq_save(flags);
+	for (i = 0; i < group->nmembers; i++) {
+		if (!cmds[i])
+			continue;
+		m = &group->members[i];
+		dev = m->dev;
 
-error:
-	/* this frees allocated memory */
-	kref_put(&dev->kref, usb_rt_delete);
+		spin_lock(&dev->err_lock);
+		if (dev->disconnected) {
+			rv = -ENODEV;
+		} else if (!dev->ongoing_read) {
+			/* a member whose read stopped can't reply */
+			rv = dev->errors ? dev->errors : -EIO;
+		} else {
+			/* anchored so cancel, suspend and disconnect kill it */
+			m->cmd_busy = true;
+			usb_anchor_urb(m->cmd_urb, &dev->submitted);
+			rv = usb_submit_urb(m->cmd_urb, GFP_ATOMIC);
+			if (rv) {
+				usb_unanchor_urb(m->cmd_urb);
+				m->cmd_busy = false;
+			}
+		}
+		spin_unlock(&dev->err_lock);
+
+		/* a member that could not be sent to fails the cycle alone */
+		if (rv) {
+			spin_lock(&group->lock);
+			if (m->pending) {
+				m->pending = false;
+				m->status = rv;
+				if (!--group->pending)
+					wake_up_interruptible(&group->wait);
+			}
+			spin_unlock(&group->lock);
+		}
+	}
+	local_irq_restore(flags);
+	retval = count;
 
+unlock:
+	mutex_unlock(&group->mutex);
+exit:
+	kfree(cmds);
+	kfree(buf);
 	return retval;
 }
 
-static void usb_rt_disconnect(struct usb_interface *interface)
+static ssize_t usb_rt_group_read(struct file *file, char __user *buffer,
+				 size_t count, loff_t *ppos)
 {
-	struct usb_rt *dev;
-	int minor = interface->minor;
+	struct usb_rt_group *group = file->private_data;
+	struct usb_rt_group_record record = { 0 };
+	struct usb_rt_group_reply reply;
+	struct usb_rt_group_member *m;
+	static const u8 pad[8];
+	unsigned long flags;
+	unsigned int i;
+	size_t size, offset;
+	u64 deadline, now;
+	int rv;
 
-	dev = usb_get_intfdata(interface);
-	if (dev->has_text_api == true)
-		device_remove_file(&interface->dev, &dev_attr_text_api);
-	device_remove_file(&interface->dev, &dev_attr_timeout_ms);
-	usb_set_intfdata(interface, NULL);
+	if (mutex_lock_interruptible(&group->mutex))
+		return -ERESTARTSYS;
 
-	/* give back our minor */
-	usb_deregister_dev(interface, &usb_rt_class);
+	if (!group->active) {
+		rv = -ENODATA;
+		goto exit;
+	}
 
-	/* prevent more I/O from starting */
-	mutex_lock(&dev->io_mutex);
-	dev->disconnected = 1;
-	mutex_unlock(&dev->io_mutex);
+	deadline = group->start_ns + (u64)group->timeout_ms * NSEC_PER_MSEC;
+	now = ktime_get_ns();
+	if (READ_ONCE(group->pending) && now < deadline) {
+		if (file->f_flags & O_NONBLOCK) {
+			rv = -EAGAIN;
+			goto exit;
+		}
+		/* one wakeup, by the last reply of the cycle */
+		rv = wait_event_interruptible_hrtimeout(group->wait,
+							!READ_ONCE(group->pending),
+							ns_to_ktime(deadline - now));
+		if (rv == -ERESTARTSYS)
+			goto exit;
+	}
 
-	usb_kill_urb(dev->bulk_in_urb);
-	usb_kill_anchored_urbs(&dev->submitted);
+	/* end the cycle, late replies are counted as unexpected */
+	spin_lock_irqsave(&group->lock, flags);
+	size = sizeof(record);
+	for (i = 0; i < group->nmembers; i++)
+		size += sizeof(reply) + ALIGN(group->members[i].len, 8);
+	if (count < size) {
+		spin_unlock_irqrestore(&group->lock, flags);
+		rv = -EMSGSIZE;
+		goto exit;
+	}
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		if (m->pending) {
+			m->pending = false;
+			m->status = -ETIMEDOUT;
+		} else if (!m->status) {
+			record.replied++;
+		}
+	}
+	group->pending = 0;
+	group->active = false;
+	record.cycle = group->cycle;
+	record.members = group->nmembers;
+	record.unexpected = group->unexpected;
+	spin_unlock_irqrestore(&group->lock, flags);
 
-	dev_info(&interface->dev, "USB RT #%d disconnected", minor);
+	/* no completion touches the members until the next write */
+	rv = -EFAULT;
+	if (copy_to_user(buffer, &record, sizeof(record)))
+		goto exit;
+	offset = sizeof(record);
+	for (i = 0; i < group->nmembers; i++) {
+		m = &group->members[i];
+		reply.status = m->status;
+		reply.len = m->len;
+		reply.reply_ns = m->reply_ns;
+		if (copy_to_user(buffer + offset, &reply, sizeof(reply)))
+			goto exit;
+		offset += sizeof(reply);
+		if (copy_to_user(buffer + offset, m->data, m->len) ||
+		    copy_to_user(buffer + offset + m->len, pad,
+				 ALIGN(m->len, 8) - m->len))
+			goto exit;
+		offset += ALIGN(m->len, 8);
+	}
+	rv = size;
 
-	/* decrement our usage count */
-	kref_put(&dev->kref, usb_rt_delete);
+exit:
+	mutex_unlock(&group->mutex);
+	return rv;
 }
 
-static void usb_rt_draw_down(struct usb_rt *dev)
+static __poll_t usb_rt_group_poll(struct file *file, struct poll_table_struct *wait)
 {
-	int time;
+	struct usb_rt_group *group = file->private_data;
 
-	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
-	if (!time)
-		usb_kill_anchored_urbs(&dev->submitted);
-	usb_kill_urb(dev->bulk_in_urb);
+	/* the deadline wakes nobody, poll with a timeout */
+	poll_wait(file, &group->wait, wait);
+	if (READ_ONCE(group->active) && !READ_ONCE(group->pending))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
 }
 
-static int usb_rt_suspend(struct usb_interface *intf, pm_message_t message)
+static const struct file_operations usb_rt_group_fops = {
+	.owner =	THIS_MODULE,
+	.read =		usb_rt_group_read,
+	.write =	usb_rt_group_write,
+	.poll =		usb_rt_group_poll,
+	.unlocked_ioctl = usb_rt_group_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+	.release =	usb_rt_group_release,
+	.llseek =	noop_llseek,
+};
+
+static int usb_rt_group_create(struct usb_rt_group_create *req)
 {
-	struct usb_rt *dev = usb_get_intfdata(intf);
+	struct usb_rt_group_member *m;
+	struct usb_rt_group *group;
+	struct usb_rt *dev;
+	__s32 *fds;
+	int rv;
 
-	if (!dev)
-		return 0;
-	usb_rt_draw_down(dev);
-	return 0;
-}
+	if (!req->count || req->count > GROUP_MEMBERS_MAX || !req->timeout_ms)
+		return -EINVAL;
 
-static int usb_rt_resume(struct usb_interface *intf)
-{
-	return 0;
-}
+	fds = memdup_user(u64_to_user_ptr(req->fds), req->count * sizeof(*fds));
+	if (IS_ERR(fds))
+		return PTR_ERR(fds);
 
-static int usb_rt_pre_reset(struct usb_interface *intf)
-{
-	struct usb_rt *dev = usb_get_intfdata(intf);
+	group = kzalloc(struct_size(group, members, req->count), GFP_KERNEL);
+	if (!group) {
+		kfree(fds);
+		return -ENOMEM;
+	}
+	spin_lock_init(&group->lock);
+	mutex_init(&group->mutex);
+	init_waitqueue_head(&group->wait);
+	group->timeout_ms = req->timeout_ms;
 
-	mutex_lock(&dev->io_mutex);
-	usb_rt_draw_down(dev);
+	while (group->nmembers < req->count) {
+		dev = usb_rt_attach(fds[group->nmembers], NULL, group,
+				    group->nmembers);
+		if (IS_ERR(dev)) {
+			rv = PTR_ERR(dev);
+			goto error;
+		}
+		m = &group->members[group->nmembers++];
+		m->dev = dev;
+		m->group = group;
+		m->size = dev->bulk_in_size;
+		m->data = kmalloc(dev->bulk_in_size, GFP_KERNEL);
+		if (!m->data) {
+			rv = -ENOMEM;
+			goto error;
+		}
+		rv = usb_rt_group_urbs_alloc(m);
+		if (rv)
+			goto error;
+	}
+	kfree(fds);
 
-	return 0;
+	rv = anon_inode_getfd("[usb_rt_group]", &usb_rt_group_fops, group,
+			      O_RDWR | O_CLOEXEC);
+	if (rv < 0)
+		usb_rt_group_free(group);
+	return rv;
+
+error:
+	kfree(fds);
+	usb_rt_group_free(group);
+	return rv;
 }
 
-static int usb_rt_post_reset(struct usb_interface *intf)
+static long usb_rt_ctl_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
 {
-	struct usb_rt *dev = usb_get_intfdata(intf);
+	struct usb_rt_ring *ring = file->private_data;
+	struct usb_rt_group_create req;
+	struct usb_rt *dev;
+	__s32 fd;
+	int retval;
+	int slot;
 
-	/* we are sure no URBs are active - no locking needed */
-	dev->errors = -EPIPE;
-	mutex_unlock(&dev->io_mutex);
+	switch (cmd) {
+	case USB_RT_IOC_RING_ENROLL:
+	case USB_RT_IOC_RING_LEAVE:
+		break;
+	case USB_RT_IOC_GROUP_CREATE:
+		if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+			return -EFAULT;
+		return usb_rt_group_create(&req);
+	default:
+		return -ENOTTY;
+	}
 
-	return 0;
+	if (get_user(fd, (__s32 __user *)arg))
+		return -EFAULT;
+	dev = usb_rt_get_fd(fd);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+
+	mutex_lock(&ring->lock);
+	for (slot = 0; slot < RING_DEVS; slot++)
+		if (ring->devs[slot] == dev)
+			break;
+
+	if (cmd == USB_RT_IOC_RING_ENROLL) {
+		retval = slot < RING_DEVS ? -EBUSY : usb_rt_ring_enroll(ring, fd);
+	} else if (slot < RING_DEVS) {
+		usb_rt_ring_leave(ring, slot);
+		retval = 0;
+	} else {
+		retval = -ENOENT;
+	}
+	mutex_unlock(&ring->lock);
+	kref_put(&dev->kref, usb_rt_delete);
+
+	return retval;
 }
 
+static const struct file_operations usb_rt_ctl_fops = {
+	.owner =	THIS_MODULE,
+	.open =		usb_rt_ctl_open,
+	.release =	usb_rt_ctl_release,
+	.mmap =		usb_rt_ctl_mmap,
+	.poll =		usb_rt_ctl_poll,
+	.unlocked_ioctl = usb_rt_ctl_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+};
+
 static struct usb_driver usb_rt_driver = {
 	.name =		"usb_rt",
 	.probe =	usb_rt_probe,
 	.disconnect =	usb_rt_disconnect,
 	.suspend =	usb_rt_suspend,
 	.resume =	usb_rt_resume,
+	.reset_resume =	usb_rt_reset_resume,
 	.pre_reset =	usb_rt_pre_reset,
 	.post_reset =	usb_rt_post_reset,
 	.id_table =	usb_rt_table,
 	.supports_autosuspend = 1,
 };
 
-module_usb_driver(usb_rt_driver);
+static int __init usb_rt_init(void)
+{
+	struct device *ctl;
+	int retval;
+
+	retval = alloc_chrdev_region(&usb_rt_devt, 0, USB_RT_MINORS + 1, "usb_rt");
+	if (retval)
+		return retval;
+
+	cdev_init(&usb_rt_cdev, &usb_rt_fops);
+	usb_rt_cdev.owner = THIS_MODULE;
+	retval = cdev_add(&usb_rt_cdev, usb_rt_devt, USB_RT_MINORS);
+	if (retval)
+		goto error_region;
+
+	cdev_init(&usb_rt_ctl_cdev, &usb_rt_ctl_fops);
+	usb_rt_ctl_cdev.owner = THIS_MODULE;
+	retval = cdev_add(&usb_rt_ctl_cdev, MKDEV(MAJOR(usb_rt_devt), USB_RT_CTL_MINOR), 1);
+	if (retval)
+		goto error_cdev;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	usb_rt_class = class_create("usb_rt");
+#else
+	usb_rt_class = class_create(THIS_MODULE, "usb_rt");
+#endif
+	if (IS_ERR(usb_rt_class)) {
+		retval = PTR_ERR(usb_rt_class);
+		goto error_ctl_cdev;
+	}
+
+	ctl = device_create(usb_rt_class, NULL, MKDEV(MAJOR(usb_rt_devt), USB_RT_CTL_MINOR),
+			    NULL, "usb_rt_ctl");
+	if (IS_ERR(ctl)) {
+		retval = PTR_ERR(ctl);
+		goto error_class;
+	}
+
+	retval = usb_register(&usb_rt_driver);
+	if (retval)
+		goto error_ctl;
+	return 0;
+
+error_ctl:
+	device_destroy(usb_rt_class, MKDEV(MAJOR(usb_rt_devt), USB_RT_CTL_MINOR));
+error_class:
+	class_destroy(usb_rt_class);
+error_ctl_cdev:
+	cdev_del(&usb_rt_ctl_cdev);
+error_cdev:
+	cdev_del(&usb_rt_cdev);
+error_region:
+	unregister_chrdev_region(usb_rt_devt, USB_RT_MINORS + 1);
+	return retval;
+}
+
+static void __exit usb_rt_exit(void)
+{
+	usb_deregister(&usb_rt_driver);
+	device_destroy(usb_rt_class, MKDEV(MAJOR(usb_rt_devt), USB_RT_CTL_MINOR));
+	class_destroy(usb_rt_class);
+	cdev_del(&usb_rt_ctl_cdev);
+	cdev_del(&usb_rt_cdev);
+	unregister_chrdev_region(usb_rt_devt, USB_RT_MINORS + 1);
+}
+
+module_init(usb_rt_init);
+module_exit(usb_rt_exit);
 
 MODULE_LICENSE("GPL v2");
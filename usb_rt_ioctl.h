@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace interface to the usb_rt driver
+ */
+#ifndef USB_RT_IOCTL_H
+#define USB_RT_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define USB_RT_IOC_MAGIC	0xD7
+
+/*
+ * Realtime mode for an open fd. While enabled and cpu_latency_us >= 0 a cpu
+ * latency pm qos request is held for the fd. A negative cpu_latency_us uses
+ * the device default from the cpu_latency_us sysfs attribute.
+ */
+struct usb_rt_realtime {
+	__u32 enable;
+	__s32 cpu_latency_us;
+};
+
+/*
+ * Out of band events. poll() reports POLLPRI while events are queued and
+ * USB_RT_IOC_GET_EVENT returns the oldest one, or fails with EAGAIN.
+ */
+enum usb_rt_event_type {
+	USB_RT_EVENT_RESUME = 1,	/* io rearmed after resume */
+	USB_RT_EVENT_RESET = 2,		/* io rearmed after device reset */
+	USB_RT_EVENT_STALL = 3,		/* endpoint stall cleared, data is the outage in ns */
+	USB_RT_EVENT_WRITE_DONE = 4,	/* zero copy write finished, data is its cookie */
+};
+
+struct usb_rt_event {
+	__u32 type;
+	__s32 status;			/* 0 or the error recovering io */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u64 data;			/* event specific */
+};
+
+/*
+ * per fd flags. LATEST_WINS, PRIORITY and COALESCE pick how writes are sent,
+ * at most one of them can be set, USB_RT_IOC_SET_FLAGS fails with EINVAL
+ * otherwise.
+ */
+#define USB_RT_FLAG_FAST_CLOSE	(1 << 0)	/* close does not wait for queued writes */
+#define USB_RT_FLAG_LATEST_WINS	(1 << 1)	/* a write replaces the pending command */
+#define USB_RT_FLAG_PRIORITY	(1 << 2)	/* writes overtake queued normal writes */
+/*
+ * Coalesced writes are collected into one transfer of records, each a little
+ * endian __u16 length followed by the data of one write.
+ */
+#define USB_RT_FLAG_COALESCE	(1 << 3)
+/*
+ * What a read timeout does with the read in flight. By default it stays
+ * submitted and the next read returns its reply. READ_UNLINK kills it,
+ * READ_DISCARD lets it complete and drops the reply. If both are set
+ * READ_UNLINK wins.
+ */
+#define USB_RT_FLAG_READ_UNLINK	(1 << 4)
+#define USB_RT_FLAG_READ_DISCARD	(1 << 5)
+#define USB_RT_FLAGS_ALL	(USB_RT_FLAG_FAST_CLOSE | USB_RT_FLAG_LATEST_WINS | \
+				 USB_RT_FLAG_PRIORITY | USB_RT_FLAG_COALESCE | \
+				 USB_RT_FLAG_READ_UNLINK | USB_RT_FLAG_READ_DISCARD)
+
+/*
+ * A zero copy write of up to 16 MiB. The pages at buf are pinned and sent
+ * with a scatter gather urb. The ioctl returns once the write is submitted,
+ * buf must stay untouched until a USB_RT_EVENT_WRITE_DONE event with the
+ * same cookie reports its status. Host controllers with sg constraints need
+ * a page aligned buf.
+ *
+ * The events are queued on the fd that submitted the write and returned by
+ * USB_RT_IOC_GET_EVENT before device events. Up to 8 writes per fd may be on
+ * the bus or have their event unread, past that the ioctl fails with EBUSY.
+ */
+struct usb_rt_sg_write {
+	__u64 buf;
+	__u64 len;
+	__u64 cookie;
+};
+
+/*
+ * Shared receive ring of a /dev/usb_rt_ctl fd. Devices are enrolled by an fd
+ * of their node with USB_RT_IOC_RING_ENROLL, after which their reads stay on
+ * the bus and every packet is published to the ring instead of read(). The
+ * fd is mapped with mmap() at offset 0 for USB_RT_RING_SIZE bytes: a header
+ * followed by USB_RT_RING_RECORDS records at record_offset.
+ *
+ * Record i is at slot i % records and committed once its seq reads i + 1
+ * (load with acquire semantics, recheck seq after copying). A seq of 0 means
+ * the record is being written, a seq larger than i + 1 that the consumer was
+ * overrun and should continue at seq - records. The consumer stores the
+ * index of the next record it wants in tail for poll().
+ *
+ * A failed read of an enrolled device is published as a record without data
+ * with USB_RT_RECORD_ERROR and the status, transient errors are retried up
+ * to 8 times in a row. With USB_RT_RECORD_STOPPED as well the device is no
+ * longer read, leave and enroll it again to restart it.
+ */
+#define USB_RT_RING_RECORDS	1024
+#define USB_RT_RECORD_DATA	480
+#define USB_RT_RECORD_TRUNCATED	(1 << 0)	/* the packet was longer than data */
+#define USB_RT_RECORD_ERROR	(1 << 1)	/* no packet, the read failed with status */
+#define USB_RT_RECORD_STOPPED	(1 << 2)	/* the read is off the bus until re-enrolled */
+
+struct usb_rt_ring_header {
+	__u32 records;
+	__u32 record_size;
+	__u32 record_offset;
+	__u32 reserved;
+	__u64 tail;			/* written by the consumer */
+};
+
+struct usb_rt_record {
+	__u64 seq;			/* index + 1 once committed */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u32 minor;			/* device that received the packet */
+	__u32 dev_seq;			/* per device packet sequence */
+	__u16 len;
+	__u16 flags;
+	__s32 status;			/* negative errno with USB_RT_RECORD_ERROR */
+	__u8 data[USB_RT_RECORD_DATA];
+};
+
+#define USB_RT_RING_RECORD_OFFSET	64
+#define USB_RT_RING_SIZE	(USB_RT_RING_RECORD_OFFSET + \
+				 USB_RT_RING_RECORDS * sizeof(struct usb_rt_record))
+
+/*
+ * A device group, created on /dev/usb_rt_ctl from an array of count fds of
+ * device nodes. The ioctl returns the group fd, the member index is the position
+ * in the array. Like ring members, group members keep their read on the bus.
+ *
+ * write() takes a vector of commands, each a struct usb_rt_group_cmd
+ * followed by len bytes, at most one per member. It sends them and starts a
+ * cycle, the first packet a commanded member receives afterwards is its
+ * reply. read() waits until all commanded members replied or timeout_ms
+ * after the write and returns a struct usb_rt_group_record followed by one
+ * struct usb_rt_group_reply per member, each followed by its data padded to
+ * 8 bytes. It fails with EMSGSIZE if the buffer is too small for the replies
+ * and with ENODATA without a cycle to read.
+ */
+struct usb_rt_group_create {
+	__u64 fds;			/* pointer to __s32 fds */
+	__u32 count;
+	__u32 timeout_ms;
+};
+
+struct usb_rt_group_cmd {
+	__u16 member;
+	__u16 len;
+};
+
+struct usb_rt_group_record {
+	__u32 cycle;
+	__u32 members;
+	__u32 replied;			/* members that replied in time */
+	__u32 unexpected;		/* packets received outside a cycle */
+};
+
+struct usb_rt_group_reply {
+	__s32 status;			/* 0, ETIMEDOUT, ENODATA if not commanded, or the error */
+	__u32 len;
+	__u64 reply_ns;			/* since the write started the cycle */
+};
+
+/*
+ * Sends the same len bytes to every member of a group with minimal skew and
+ * waits up to the group timeout for them to complete. times, if not 0,
+ * points to one struct usb_rt_broadcast_time per member that reports when
+ * each urb was submitted and completed (CLOCK_MONOTONIC).
+ */
+struct usb_rt_group_broadcast {
+	__u64 buf;
+	__u64 times;
+	__u32 len;
+	__u32 reserved;
+};
+
+struct usb_rt_broadcast_time {
+	__s32 status;
+	__u32 reserved;
+	__u64 submit_ns;
+	__u64 complete_ns;
+};
+
+/*
+ * A tap fd, created on a device fd, sees a decimated copy of the packets
+ * the device receives without taking them from its reader. Exactly one of
+ * every (every Nth packet) and interval_us (at most one packet per
+ * interval) is set. Without fields a read() returns the latest packet. With
+ * nfields little endian floats at the byte offsets in fields, packets are
+ * aggregated per window of every packets or interval_us instead and read()
+ * returns a struct usb_rt_tap_window. Only the latest result is kept.
+ */
+#define USB_RT_TAP_FIELDS	16
+
+struct usb_rt_tap_config {
+	__u32 every;
+	__u32 interval_us;
+	__u32 nfields;
+	__u16 fields[USB_RT_TAP_FIELDS];
+	__u32 reserved;
+};
+
+struct usb_rt_tap_field {
+	__u32 min;			/* float bits */
+	__u32 max;			/* float bits */
+	__s64 mean_q16;			/* fixed point, 16 fraction bits */
+};
+
+struct usb_rt_tap_window {
+	__u64 start_ns;
+	__u64 end_ns;
+	__u32 packets;
+	__u32 fields;
+	struct usb_rt_tap_field field[];
+};
+
+/*
+ * A control packet (first byte 0) taken from the receive path while the
+ * control_queue attribute is set, returned by USB_RT_IOC_GET_CONTROL. Only
+ * the first len bytes of data are copied. The packets following a long
+ * packet header until its total length is in are returned as well, flagged
+ * USB_RT_CONTROL_CONTINUATION; each starts with its own 8 byte header.
+ * A new control packet or a failed, cancelled or stalled read ends the
+ * long packet early, the rest is then returned as data.
+ */
+#define USB_RT_CONTROL_DATA	512
+#define USB_RT_CONTROL_TRUNCATED	(1 << 0)	/* the packet was longer than data */
+#define USB_RT_CONTROL_CONTINUATION	(1 << 1)	/* more of the preceding long packet */
+
+struct usb_rt_control {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u32 len;
+	__u32 flags;
+	__u8 data[USB_RT_CONTROL_DATA];
+};
+
+#define USB_RT_IOC_SET_REALTIME	_IOW(USB_RT_IOC_MAGIC, 1, struct usb_rt_realtime)
+#define USB_RT_IOC_GET_EVENT	_IOR(USB_RT_IOC_MAGIC, 2, struct usb_rt_event)
+#define USB_RT_IOC_SET_FLAGS	_IOW(USB_RT_IOC_MAGIC, 3, __u32)
+#define USB_RT_IOC_GET_FLAGS	_IOR(USB_RT_IOC_MAGIC, 4, __u32)
+/* kill all writes in flight, returns how many this call dropped before they completed */
+#define USB_RT_IOC_CANCEL_WRITES	_IO(USB_RT_IOC_MAGIC, 5)
+/* kill the read in flight, a read waiting for it fails with ECANCELED, EBUSY while enrolled */
+#define USB_RT_IOC_CANCEL_READ	_IO(USB_RT_IOC_MAGIC, 6)
+#define USB_RT_IOC_WRITE_SG	_IOW(USB_RT_IOC_MAGIC, 7, struct usb_rt_sg_write)
+/* on /dev/usb_rt_ctl, the argument is an fd of a device node */
+#define USB_RT_IOC_RING_ENROLL	_IOW(USB_RT_IOC_MAGIC, 8, __s32)
+#define USB_RT_IOC_RING_LEAVE	_IOW(USB_RT_IOC_MAGIC, 9, __s32)
+#define USB_RT_IOC_GROUP_CREATE	_IOW(USB_RT_IOC_MAGIC, 10, struct usb_rt_group_create)
+/* on a group fd */
+#define USB_RT_IOC_GROUP_BROADCAST	_IOW(USB_RT_IOC_MAGIC, 11, struct usb_rt_group_broadcast)
+/* on a device fd, returns the tap fd, EBUSY past 8 taps per device */
+#define USB_RT_IOC_TAP		_IOW(USB_RT_IOC_MAGIC, 12, struct usb_rt_tap_config)
+/* pops the oldest queued control packet, EAGAIN if there is none */
+#define USB_RT_IOC_GET_CONTROL	_IOR(USB_RT_IOC_MAGIC, 13, struct usb_rt_control)
+
+#endif